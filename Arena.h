@@ -0,0 +1,208 @@
+//
+//  Arena.h
+//  ConcurrentMerkle
+//
+//  Per-thread slab allocation for tree nodes and descriptors.
+//
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <vector>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+/**
+ * Class NodeArena
+ * Small fixed size blocks for the objects every update allocates (nodes and descriptors). Blocks are grouped in size
+ * classes of GRAIN bytes and each thread keeps a free list per class, so allocating and freeing is a pointer swap on
+ * memory no other thread writes. A freed block goes to the free list of the thread that frees it. With a reclaimer
+ * that is the thread collecting its retire list, which is also one that allocates.
+ *
+ * New blocks are carved from a per-thread run of CHUNK bytes, taken from slabs of SLAB bytes that are shared by all
+ * threads. Slabs are never returned to the system, a freed block is only ever reused. They are aligned to their size
+ * and on Linux the kernel is asked to back them with huge pages, which saves TLB misses when walking big trees.
+ *
+ * A thread whose free list for a class grows past 2 * BATCH blocks passes BATCH of them to a shared list, where a
+ * thread that runs dry picks them up before carving new ones. A thread that exits passes on everything it holds.
+ * Blocks of sizes above MAX_SIZE come from the global allocator.
+ */
+class NodeArena {
+public:
+    static const std::size_t GRAIN = 16;
+    static const std::size_t MAX_SIZE = 512;
+    // the alignment of blocks whose size is a multiple of it, enough for any type aligned to a cache line
+    static const std::size_t MAX_ALIGN = 64;
+    static const std::size_t CHUNK = 64 * 1024;
+    static const std::size_t SLAB = 2 * 1024 * 1024;
+    static const std::size_t BATCH = 256;
+
+    static void* allocate(std::size_t size) {
+        if (size > MAX_SIZE)
+            return ::operator new(size, std::align_val_t(MAX_ALIGN));
+        Cache& cache = local();
+        std::size_t c = sizeClass(size);
+        if (cache.free[c] == nullptr)
+            cache.refill(c);
+        Block* block = cache.free[c];
+        cache.free[c] = block->next;
+        cache.count[c]--;
+        return block;
+    };
+
+    static void deallocate(void* p, std::size_t size) {
+        if (size > MAX_SIZE) {
+            ::operator delete(p, std::align_val_t(MAX_ALIGN));
+            return;
+        }
+        Cache& cache = local();
+        std::size_t c = sizeClass(size);
+        Block* block = static_cast<Block*>(p);
+        block->next = cache.free[c];
+        cache.free[c] = block;
+        if (++cache.count[c] >= 2 * BATCH)
+            cache.spill(c);
+    };
+
+private:
+    static const std::size_t CLASSES = MAX_SIZE / GRAIN;
+
+    struct Block {
+        Block* next;
+    };
+
+    // a list of freed blocks handed between threads
+    struct Batch {
+        Block* head;
+        std::size_t count;
+    };
+
+    // What the threads share, guarded by lock
+    struct Shared {
+        std::mutex lock;
+        // every slab, kept reachable for leak checkers
+        std::vector<void*> slabs;
+        char* cursor = nullptr;
+        char* end = nullptr;
+        std::vector<Batch> batches[CLASSES];
+        // runs of exited threads that were not used up
+        std::vector<std::pair<char*, char*>> runs;
+    };
+
+    struct Cache {
+        Block* free[CLASSES] = {};
+        std::size_t count[CLASSES] = {};
+        char* cursor = nullptr;
+        char* end = nullptr;
+
+        ~Cache() {
+            Shared& shared = NodeArena::shared();
+            std::lock_guard<std::mutex> guard(shared.lock);
+            for (std::size_t c = 0; c < CLASSES; c++) {
+                if (this->free[c] != nullptr)
+                    shared.batches[c].push_back({this->free[c], this->count[c]});
+            }
+            if (this->cursor != this->end)
+                shared.runs.push_back({this->cursor, this->end});
+        };
+
+        // Takes a batch of freed blocks, or carves new ones if there is none.
+        void refill(std::size_t c) {
+            Shared& shared = NodeArena::shared();
+            std::size_t size = (c + 1) * GRAIN;
+            {
+                std::lock_guard<std::mutex> guard(shared.lock);
+                if (!shared.batches[c].empty()) {
+                    Batch batch = shared.batches[c].back();
+                    shared.batches[c].pop_back();
+                    this->free[c] = batch.head;
+                    this->count[c] = batch.count;
+                    return;
+                }
+            }
+            for (std::size_t i = 0; i < BATCH; i++) {
+                Block* block = static_cast<Block*>(this->carve(size));
+                block->next = this->free[c];
+                this->free[c] = block;
+                this->count[c]++;
+            }
+        };
+
+        // Passes the BATCH blocks at the head of the list to the shared lists.
+        void spill(std::size_t c) {
+            Batch batch = {this->free[c], BATCH};
+            Block* last = this->free[c];
+            for (std::size_t i = 1; i < BATCH; i++)
+                last = last->next;
+            this->free[c] = last->next;
+            this->count[c] -= BATCH;
+            last->next = nullptr;
+            Shared& shared = NodeArena::shared();
+            std::lock_guard<std::mutex> guard(shared.lock);
+            shared.batches[c].push_back(batch);
+        };
+
+        void* carve(std::size_t size) {
+            std::size_t align = size % MAX_ALIGN == 0 ? MAX_ALIGN : GRAIN;
+            char* p = alignUp(this->cursor, align);
+            if (this->cursor == nullptr || p + size > this->end) {
+                this->take();
+                p = alignUp(this->cursor, align);
+            }
+            this->cursor = p + size;
+            return p;
+        };
+
+        // Replaces the current run with a new one, the rest of the old one is dropped.
+        void take() {
+            Shared& shared = NodeArena::shared();
+            std::lock_guard<std::mutex> guard(shared.lock);
+            if (!shared.runs.empty()) {
+                std::tie(this->cursor, this->end) = shared.runs.back();
+                shared.runs.pop_back();
+                if (this->end - this->cursor >= (std::ptrdiff_t) (MAX_SIZE + MAX_ALIGN))
+                    return;
+            }
+            if (shared.cursor == shared.end) {
+                void* slab = std::aligned_alloc(SLAB, SLAB);
+                if (slab == nullptr)
+                    throw std::bad_alloc();
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+                madvise(slab, SLAB, MADV_HUGEPAGE);
+#endif
+                shared.slabs.push_back(slab);
+                shared.cursor = static_cast<char*>(slab);
+                shared.end = shared.cursor + SLAB;
+            }
+            this->cursor = shared.cursor;
+            this->end = shared.cursor + CHUNK;
+            shared.cursor = this->end;
+        };
+    };
+
+    static std::size_t sizeClass(std::size_t size) { return size == 0 ? 0 : (size - 1) / GRAIN; };
+
+    static char* alignUp(char* p, std::size_t align) {
+        return reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(p) + align - 1) & ~(std::uintptr_t) (align - 1));
+    };
+
+    // never destroyed, blocks may still be freed by static objects and exiting threads at shutdown
+    static Shared& shared() {
+        static Shared* instance = new Shared();
+        return *instance;
+    };
+
+    static Cache& local() {
+        thread_local Cache cache;
+        return cache;
+    };
+};
+
+#endif //ARENA_H
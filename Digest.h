@@ -0,0 +1,265 @@
+//
+//  Digest.h
+//  ConcurrentMerkle
+//
+//  Fixed size binary digests stored inline in tree nodes.
+//
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * Class Digest
+ * A fixed length binary digest. Nodes keep their hash in this form and the hex string is only produced at the API
+ * boundary (getRootValue, printing). N must be a multiple of 8 so the digest can be handled as 64-bit words.
+ */
+template<std::size_t N>
+class Digest {
+    static_assert(N % 8 == 0, "Digest length must be a multiple of 8 bytes");
+
+public:
+    static const std::size_t SIZE = N;
+    static const std::size_t WORDS = N / 8;
+
+    alignas(8) unsigned char bytes[N];
+
+    // An all zero digest, used as the value of an empty HASH node
+    Digest() { std::memset(this->bytes, 0, N); };
+
+    Digest(const unsigned char* raw) { std::memcpy(this->bytes, raw, N); };
+
+    std::uint64_t word(std::size_t i) const {
+        std::uint64_t w;
+        std::memcpy(&w, this->bytes + (i << 3), sizeof(w));
+        return w;
+    };
+
+    void setWord(std::size_t i, std::uint64_t w) { std::memcpy(this->bytes + (i << 3), &w, sizeof(w)); };
+
+    // Equality is a handful of 64-bit compares rather than a string compare
+    bool operator==(const Digest& other) const {
+        for (std::size_t i = 0; i < WORDS; i++) {
+            if (this->word(i) != other.word(i))
+                return false;
+        }
+        return true;
+    };
+
+    bool operator!=(const Digest& other) const { return !(*this == other); };
+
+    // Lowercase hex encoding, matches the output of the sha256()/md5() string helpers.
+    std::string hex() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string out(2 * N, '0');
+        for (std::size_t i = 0; i < N; i++) {
+            out[2 * i] = digits[this->bytes[i] >> 4];
+            out[2 * i + 1] = digits[this->bytes[i] & 0x0f];
+        }
+        return out;
+    };
+
+    // Parses the hex output of a string hashing function back into binary form.
+    static Digest fromHex(const std::string& hex) {
+        Digest result;
+        for (std::size_t i = 0; i < N && 2 * i + 1 < hex.size(); i++)
+            result.bytes[i] = (unsigned char) ((nibble(hex[2 * i]) << 4) | nibble(hex[2 * i + 1]));
+        return result;
+    };
+
+private:
+    static unsigned char nibble(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return 0;
+    };
+};
+
+/**
+ * How the trees turn a leaf digest into the key that routes it left/right down the trie.
+ *  STD_HASH     std::hash over the digest bytes, a 64 bit key
+ *  DIGEST_BITS  the digest bits themselves, as deep as the digest is long and no second hash per operation
+ */
+enum class KeyMode { STD_HASH, DIGEST_BITS };
+
+/**
+ * Class DigestKey
+ * A routing key read straight out of a digest. The digest is treated as one little endian integer of 8 * N bits and
+ * the key behaves like an unsigned integer that is shifted right as the walk descends: key % 2 is the current
+ * direction and key >>= 1 moves to the next level. Shifting only advances a bit offset, the digest is never copied
+ * or shifted. Bits past the end of the digest read as zero, just like an exhausted std::size_t key.
+ */
+template<std::size_t N>
+class DigestKey {
+public:
+    DigestKey() : digest(), offset(0) {};
+
+    DigestKey(const Digest<N>& d) : digest(d), offset(0) {};
+
+    // The next 64 key bits, lowest bit first
+    std::uint64_t low() const {
+        std::size_t i = this->offset >> 6;
+        unsigned int shift = this->offset & 63;
+        if (i >= Digest<N>::WORDS)
+            return 0;
+        std::uint64_t result = this->word(i) >> shift;
+        if (shift != 0 && i + 1 < Digest<N>::WORDS)
+            result |= this->word(i + 1) << (64 - shift);
+        return result;
+    };
+
+    // m must be a power of two
+    std::size_t operator%(std::size_t m) const { return this->low() & (m - 1); };
+
+    DigestKey& operator>>=(unsigned int shift) {
+        this->offset += shift;
+        return *this;
+    };
+
+    DigestKey operator>>(unsigned int shift) const {
+        DigestKey result = *this;
+        result >>= shift;
+        return result;
+    };
+
+private:
+    Digest<N> digest;
+    std::size_t offset;
+
+    // words are read little endian so the routing, and with it the root digest, is the same on every platform
+    std::uint64_t word(std::size_t i) const {
+        std::uint64_t w = 0;
+        for (int b = 7; b >= 0; b--)
+            w = (w << 8) | this->digest.bytes[(i << 3) + b];
+        return w;
+    };
+};
+
+/**
+ * Class AtomicDigest
+ * A Digest that can be read and replaced by concurrent threads. The digest words live inline in two copies next to
+ * a version counter. The even version v names the copy (v / 2) % 2 as the current one. A writer makes the version
+ * odd to claim the other copy, stores its words there and then publishes them by moving the version on to v + 2.
+ *
+ * Readers never wait for a writer. While the version is odd the copy of the last even version is still complete
+ * and is read instead. The copy a reader copied is only written again by the writer after next, so the read is
+ * retried only if the version has moved past v + 2 by the time the words are copied, which takes two writers
+ * getting in meanwhile.
+ *
+ * The version doubles as the "has this changed since I read it" check that the old std::string* compare and swap
+ * provided: a writer reads the version, computes a new digest, and compareExchange only succeeds if no other
+ * writer got in first. Unlike that compare and swap the claim and the publish are two steps. A writer stalled in
+ * between holds up no reader, but the other writers of the same node lose their compare and swaps to it, as they
+ * would to a winner, until it resumes.
+ *
+ * A second digest derived from the first can be stored with it under the same version, with a tag saying how it was
+ * derived. The trees keep the digest of a compressed node lifted through the levels it skips there, see
+ * MerkleTree::childDigest. Without one the lifted digest is the digest itself and the tag 0.
+ */
+template<std::size_t N>
+class AtomicDigest {
+public:
+    typedef Digest<N> digest_type;
+
+    AtomicDigest() {
+        this->ver.store(0, std::memory_order_relaxed);
+        for (Copy& copy : this->copies) {
+            for (std::size_t i = 0; i < 2 * digest_type::WORDS; i++)
+                copy.words[i].store(0, std::memory_order_relaxed);
+            copy.tag.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    AtomicDigest(const digest_type& d) : AtomicDigest() { this->init(d); };
+
+    // Returns the (even) version of the current digest, the one before the write in progress if there is one.
+    std::uint64_t version() const {
+        return this->ver.load(std::memory_order_acquire) & ~std::uint64_t(1);
+    };
+
+    // Returns a consistent copy of the digest.
+    digest_type load() const {
+        std::uint64_t v;
+        return this->load(v);
+    };
+
+    // Returns a consistent copy of the digest along with the version it was read at.
+    digest_type load(std::uint64_t &v) const {
+        digest_type lifted;
+        std::uint64_t t;
+        return this->load(v, lifted, t);
+    };
+
+    // Returns a consistent copy of the digest, and of the lifted digest and its tag, along with the version.
+    digest_type load(std::uint64_t &v, digest_type &lifted, std::uint64_t &t) const {
+        digest_type result;
+        while (true) {
+            v = this->version();
+            const Copy& copy = this->copies[(v >> 1) & 1];
+            for (std::size_t i = 0; i < digest_type::WORDS; i++) {
+                result.setWord(i, copy.words[i].load(std::memory_order_relaxed));
+                lifted.setWord(i, copy.words[digest_type::WORDS + i].load(std::memory_order_relaxed));
+            }
+            t = copy.tag.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // the writer claiming v + 3 is the first to store into this copy again
+            if (this->ver.load(std::memory_order_relaxed) <= v + 2)
+                return result;
+        }
+    };
+
+    /**
+     * Stores desired if the version is still expected. On failure expected is left untouched and the caller is
+     * expected to reload the version and recompute.
+     */
+    bool compareExchange(std::uint64_t expected, const digest_type& desired) {
+        return this->compareExchange(expected, desired, desired, 0);
+    };
+
+    // compareExchange that stores a lifted digest and its tag along with desired
+    bool compareExchange(std::uint64_t expected, const digest_type& desired, const digest_type& lifted,
+                         std::uint64_t t) {
+        if (!this->ver.compare_exchange_strong(expected, expected + 1, std::memory_order_acq_rel))
+            return false;
+        // keeps the word stores below from becoming visible before the odd version, pairs with the fence in load
+        std::atomic_thread_fence(std::memory_order_release);
+        this->store(this->copies[((expected >> 1) + 1) & 1], desired, lifted, t);
+        this->ver.store(expected + 2, std::memory_order_release);
+        return true;
+    };
+
+    // Sets the digest of a node that has not yet been published to other threads.
+    void init(const digest_type& d) { this->init(d, d, 0); };
+
+    void init(const digest_type& d, const digest_type& lifted, std::uint64_t t) {
+        this->store(this->copies[(this->ver.load(std::memory_order_relaxed) >> 1) & 1], d, lifted, t);
+    };
+
+private:
+    struct Copy {
+        // the digest, then the lifted digest
+        std::atomic<std::uint64_t> words[2 * digest_type::WORDS];
+        std::atomic<std::uint64_t> tag;
+    };
+
+    std::atomic<std::uint64_t> ver;
+    Copy copies[2];
+
+    static void store(Copy& copy, const digest_type& d, const digest_type& lifted, std::uint64_t t) {
+        for (std::size_t i = 0; i < digest_type::WORDS; i++) {
+            copy.words[i].store(d.word(i), std::memory_order_relaxed);
+            copy.words[digest_type::WORDS + i].store(lifted.word(i), std::memory_order_relaxed);
+        }
+        copy.tag.store(t, std::memory_order_relaxed);
+    };
+};
+
+#endif //DIGEST_H
@@ -0,0 +1,236 @@
+//
+//  HashPolicy.h
+//  ConcurrentMerkle
+//
+//  Compile time hash policies for the merkle trees.
+//
+
+#ifndef HASHPOLICY_H
+#define HASHPOLICY_H
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include "Digest.h"
+#include "blake3.h"
+#include "md5.h"
+#include "sha256.h"
+
+/**
+ * A HashPolicy tells the trees how to hash. Every policy provides
+ *  - digest_type                 the fixed size Digest stored in the nodes
+ *  - Hasher                      a streaming hasher with update(std::span<const std::byte>) and finalize()
+ *  - hasher()                    returns a fresh Hasher
+ *  - hash(data)                  one shot hash of a byte span (leaf values)
+ *  - combine(left, right)        hash of an interior node with two children
+ *  - combine(child)              hash of an interior node with a single child
+ * and may provide
+ *  - hashMany(msgs, len, n, out) hashes n independent messages of len bytes at once
+ *  - lanes()                     with hashMany, how many of them it hashes side by side on this machine
+ *
+ * The trees keep an instance of the policy, stateless policies cost nothing and let every call be inlined.
+ */
+
+/**
+ * Class Sha256Policy
+ * SHA-256 through the SHA256 class, no allocations per hash.
+ */
+class Sha256Policy {
+public:
+    typedef Digest<SHA256::DIGEST_SIZE> digest_type;
+
+    class Hasher {
+    public:
+        Hasher() { this->ctx.init(); };
+
+        void update(std::span<const std::byte> data) {
+            this->ctx.update((const unsigned char*) data.data(), (unsigned int) data.size());
+        };
+
+        digest_type finalize() {
+            digest_type result;
+            this->ctx.final(result.bytes);
+            return result;
+        };
+
+    private:
+        SHA256 ctx;
+    };
+
+    Hasher hasher() const { return Hasher(); };
+
+    digest_type hash(std::span<const std::byte> data) const {
+        Hasher h;
+        h.update(data);
+        return h.finalize();
+    };
+
+    // Interior nodes go through the fixed length kernels with the precomputed padding schedule
+    digest_type combine(const digest_type& left, const digest_type& right) const {
+        digest_type result;
+        sha256_hash_children(left.bytes, right.bytes, result.bytes);
+        return result;
+    };
+
+    digest_type combine(const digest_type& child) const {
+        digest_type result;
+        sha256_hash_child(child.bytes, result.bytes);
+        return result;
+    };
+
+    // Batched hashing through the multi-buffer kernels, the digests are written straight into out
+    void hashMany(const unsigned char* const* messages, unsigned int len, unsigned int count, digest_type* out) const {
+        static_assert(sizeof(digest_type) == SHA256::DIGEST_SIZE, "digests must be packed back to back");
+        sha256_many(messages, len, count, (unsigned char*) out);
+    };
+
+    // 1 with SHA-NI, whose single stream beats the multi-buffer kernels
+    unsigned int lanes() const { return sha256_many_lanes(); };
+};
+
+/**
+ * Class Blake3Policy
+ * BLAKE3 through the BLAKE3 class. Not SHA-256 compatible, but an interior node is a single compression and leaves
+ * batch across the AVX2 / AVX-512 lanes.
+ */
+class Blake3Policy {
+public:
+    typedef Digest<BLAKE3::DIGEST_SIZE> digest_type;
+
+    class Hasher {
+    public:
+        Hasher() { this->ctx.init(); };
+
+        void update(std::span<const std::byte> data) {
+            this->ctx.update((const unsigned char*) data.data(), data.size());
+        };
+
+        digest_type finalize() {
+            digest_type result;
+            this->ctx.final(result.bytes);
+            return result;
+        };
+
+    private:
+        BLAKE3 ctx;
+    };
+
+    Hasher hasher() const { return Hasher(); };
+
+    digest_type hash(std::span<const std::byte> data) const {
+        Hasher h;
+        h.update(data);
+        return h.finalize();
+    };
+
+    digest_type combine(const digest_type& left, const digest_type& right) const {
+        digest_type result;
+        blake3_hash_children(left.bytes, right.bytes, result.bytes);
+        return result;
+    };
+
+    digest_type combine(const digest_type& child) const {
+        digest_type result;
+        blake3_hash_child(child.bytes, result.bytes);
+        return result;
+    };
+
+    void hashMany(const unsigned char* const* messages, unsigned int len, unsigned int count, digest_type* out) const {
+        static_assert(sizeof(digest_type) == BLAKE3::DIGEST_SIZE, "digests must be packed back to back");
+        blake3_many(messages, len, count, (unsigned char*) out);
+    };
+
+    unsigned int lanes() const { return blake3_many_lanes(); };
+};
+
+/**
+ * Class Md5Policy
+ * MD5 through the MD5 class, 16 byte digests.
+ */
+class Md5Policy {
+public:
+    typedef Digest<16> digest_type;
+
+    class Hasher {
+    public:
+        void update(std::span<const std::byte> data) {
+            this->ctx.update((const unsigned char*) data.data(), (MD5::size_type) data.size());
+        };
+
+        digest_type finalize() { return digest_type(this->ctx.finalize().rawdigest()); };
+
+    private:
+        MD5 ctx;
+    };
+
+    Hasher hasher() const { return Hasher(); };
+
+    digest_type hash(std::span<const std::byte> data) const {
+        Hasher h;
+        h.update(data);
+        return h.finalize();
+    };
+
+    digest_type combine(const digest_type& left, const digest_type& right) const {
+        Hasher h;
+        h.update(std::as_bytes(std::span(left.bytes)));
+        h.update(std::as_bytes(std::span(right.bytes)));
+        return h.finalize();
+    };
+
+    digest_type combine(const digest_type& child) const {
+        return this->hash(std::as_bytes(std::span(child.bytes)));
+    };
+};
+
+/**
+ * Class FunctionHashPolicy
+ * Type erased adapter for the original std::string (*)(std::string) hash functions returning hex strings (sha256,
+ * md5). It produces the same digests as the matching static policy but pays for a string copy and a hex round trip
+ * on every hash, prefer Sha256Policy / Md5Policy.
+ */
+template<std::size_t DigestSize>
+class FunctionHashPolicy {
+public:
+    typedef Digest<DigestSize> digest_type;
+    typedef std::string (*hash_func)(std::string);
+
+    class Hasher {
+    public:
+        Hasher(hash_func f) : func(f) {};
+
+        void update(std::span<const std::byte> data) { this->input.append((const char*) data.data(), data.size()); };
+
+        digest_type finalize() { return digest_type::fromHex(this->func(this->input)); };
+
+    private:
+        hash_func func;
+        std::string input;
+    };
+
+    FunctionHashPolicy(hash_func f) : func(f) {};
+
+    Hasher hasher() const { return Hasher(this->func); };
+
+    digest_type hash(std::span<const std::byte> data) const {
+        Hasher h = this->hasher();
+        h.update(data);
+        return h.finalize();
+    };
+
+    digest_type combine(const digest_type& left, const digest_type& right) const {
+        Hasher h = this->hasher();
+        h.update(std::as_bytes(std::span(left.bytes)));
+        h.update(std::as_bytes(std::span(right.bytes)));
+        return h.finalize();
+    };
+
+    digest_type combine(const digest_type& child) const {
+        return this->hash(std::as_bytes(std::span(child.bytes)));
+    };
+
+private:
+    hash_func func;
+};
+
+#endif //HASHPOLICY_H
@@ -6,62 +6,177 @@
 #define MERKLETREE_H
 
 #include <iostream>
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
 #include <stack>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "Arena.h"
+#include "Digest.h"
+#include "HashPolicy.h"
+#include "Reclaimer.h"
+#include "Serializer.h"
 
 namespace Concurrent {
 
-// The tree has two child nodes, left and right.
+// The two children of a binary node, left and right. Wider nodes number their children from 0 to Radix - 1.
 enum Direction { LEFT, RIGHT };
-// Merkle trees contain two types of nodes, HASH, and DATA
-enum NodeType { HASH, DATA };
+// Merkle trees contain two types of nodes, HASH, and DATA. EMPTY takes the place of a removed DATA node, it hashes and
+// routes like an empty slot but is never stored twice, so a stale descriptor can not mistake a refilled slot for its own.
+enum NodeType { HASH, DATA, EMPTY };
+// The operations a Descriptor describes. INSERT_HASH places an intermediary HASH node above a DATA node or a compressed
+// HASH node, REMOVE swaps a DATA node for an EMPTY one and COLLAPSE swaps a frozen HASH node for what is left of it.
+// FREEZE is installed on a HASH node for good, no other descriptor can follow it. Filling an empty slot needs none.
+enum OpType { INSERT_HASH, REMOVE, COLLAPSE, FREEZE };
 
 /**
  * Class MerkleTree
- *
+ * HashPolicy decides how leaves and interior nodes are hashed and the digest type stored in the nodes, see
+ * HashPolicy.h. Sha256Policy and Md5Policy are resolved at compile time, FunctionHashPolicy wraps the original
+ * std::string (*)(std::string) functions.
+ * Mode picks the routing key, KeyMode::DIGEST_BITS routes on the leaf digest itself (see Digest.h).
+ * Reclaimer frees replaced descriptors and removed nodes once no thread can still be reading them, see Reclaimer.h.
+ * Radix is the number of children of an interior node, a power of two up to 256. Every level routes on log2(Radix)
+ * key bits, so wider nodes make a shallower tree, and an interior digest hashes the concatenation of the digests of
+ * all its present children in one call. The root depends on Radix, Sequential::MerkleTree matches the binary tree.
+ * Interior nodes are path compressed: a HASH node only sits at a level where the values below it part ways, the single
+ * child levels above it are skipped (see MerkleNode::level). The root is still that of the uncompressed tree.
+ * T is stored in the leaves. A pointer T is hashed through what it points to (see MerkleSerializer) and the tree owns
+ * the pointee of every value it takes, it is deleted when the value is removed or the tree destroyed. A value equal to
+ * one already in the tree is not taken, insert returns false and a pointer stays with the caller. Any other T is moved into the leaf next
+ * to its digest, so small values cost no allocation and no second cache miss of their own.
  */
-template<typename T>
+template<typename T, typename HashPolicy = Sha256Policy, KeyMode Mode = KeyMode::STD_HASH,
+         typename Reclaimer = EpochReclaimer, unsigned int Radix = 2>
 class MerkleTree {
+    static_assert(Radix >= 2 && Radix <= 256 && std::has_single_bit(Radix), "Radix must be a power of two up to 256");
     
 protected:
     class MerkleNode;
+    class LeafNode;
+    class HashNode;
     class Descriptor;
     
 public:
+    typedef typename HashPolicy::digest_type digest_type;
+    typedef std::conditional_t<Mode == KeyMode::DIGEST_BITS, DigestKey<digest_type::SIZE>, std::size_t> key_type;
+    // a key as HASH nodes keep it, a DigestKey is rebuilt from the digest it reads
+    typedef std::conditional_t<Mode == KeyMode::DIGEST_BITS, digest_type, std::size_t> prefix_type;
+    
+    /**
+     * What a client needs to check that a value is in a tree with a given root, see prove and verify. levels has an
+     * entry for every interior node of the uncompressed tree from the leaf up to the root: the number of its other
+     * children, whose digests follow each other in siblings, and where among them the digest from below goes.
+     */
+    struct Proof {
+        struct Level {
+            unsigned int count;
+            unsigned int position;
+        };
+        // the digest of the value and the root the proof leads to
+        digest_type leaf;
+        digest_type root;
+        std::vector<Level> levels;
+        std::vector<digest_type> siblings;
+    };
     
     //TODO: There may be a better wayt to declare this sentinal node value
     inline static MerkleNode* nullNode = nullptr;
     
     /**
-     * Constructor to create a merkle tree object. The required parameter is a hashing function
-     * which takes an std::string and returns the hash as an std::string
+     * Constructor to create a merkle tree object hashing with the given policy.
+     * shardBits (at most MAX_SHARD_BITS, rounded down to whole levels) makes the top levels of the tree permanent: the
+     * first shardBits routing bits pick one of 2^shardBits shard roots that are never collapsed, and updates stop
+     * rehashing at their shard root. The levels above are only combined when the root is read or a proof needs them,
+     * writers only mark them dirty, see summarize. The root is the same as without shards.
+     */
+    MerkleTree(HashPolicy policy = HashPolicy(), unsigned int shardBits = 0)
+        : hashPolicy(policy), shardLevels(std::min(shardBits, MAX_SHARD_BITS) / RADIX_BITS) {
+        this->root.store(this->buildTop(0));
+    };
+    
+    /**
+     * Constructor taking a hashing function which takes an std::string and returns the hash as a hex std::string.
+     * Only available when the policy is the type erased FunctionHashPolicy adapter.
      */
-    MerkleTree(std::string (*hash_func)(std::string)) {
-        this->hashFunc = hash_func;
-        this->root.store(new MerkleNode());
+    MerkleTree(std::string (*hash_func)(std::string), unsigned int shardBits = 0)
+        requires std::is_constructible_v<HashPolicy, std::string (*)(std::string)>
+        : hashPolicy(hash_func), shardLevels(std::min(shardBits, MAX_SHARD_BITS) / RADIX_BITS) {
+        this->root.store(this->buildTop(0));
     };
 
+    /**
+     * Builds a tree from an existing dataset in one pass instead of replaying insert(). The leaves are hashed in
+     * parallel, then split on their routing digits level by level and the subtrees below a split are built on
+     * separate threads until every thread has one. With a multi-buffer kernel the leaves, and the interior nodes of
+     * every small subtree once it is built, are hashed in batches. Gives the same tree, and root, as inserting the
+     * values one at a time.
+     * Like insert_bulk the tree takes pointers and copies other values, of equal values only the first is taken. The
+     * pointers that were taken are set to nullptr in values, what is left there stays with the caller.
+     */
+    template<std::ranges::random_access_range Range>
+    static MerkleTree* build(Range&& values, unsigned int threads = std::thread::hardware_concurrency(),
+                             HashPolicy policy = HashPolicy(), unsigned int shardBits = 0);
+
     ~MerkleTree() {
         // call recursive helper function
         this->post_delete(root.load());
         delete nullNode;
     };
     
-    // Inserts a value into the tree
-    void insert(T &v) {
-        std::string* hash = new std::string(hashFunc(std::to_string(*v)));
-        size_t key = gen_key(*hash);
-        this->update(hash, key, v);
+    // Inserts a value into the tree, it is moved into its leaf. Returns false if an equal value is already in the tree,
+    // the value is then not taken.
+    bool insert(T v) {
+        digest_type hash = leafHash(v);
+        return this->update(hash, routeKey(hash), std::move(v), this->lazy);
+    };
+    
+    /**
+     * Inserts a batch of values. The leaves are linked by up to threads workers that only mark their paths dirty, then
+     * every interior node the batch touched is rehashed once, bottom up, with the subtrees split between the workers.
+     * In lazy mode that rehash is left to the next flush like for any other update. Safe to run alongside other
+     * operations, the tree takes pointers like insert does and copies other values. Returns the number of values
+     * taken, a value equal to one already in the tree (or earlier in the batch) is not. The pointers that were taken
+     * are set to nullptr in values, what is left there stays with the caller.
+     */
+    std::size_t insert_bulk(std::span<T> values, unsigned int threads = std::thread::hardware_concurrency()) {
+        threads = (unsigned int) std::clamp<std::size_t>(values.size(), 1, std::max(1u, threads));
+        std::atomic<std::size_t> taken{0};
+        auto work = [this, values, threads, &taken](unsigned int id) {
+            std::size_t end = values.size() * (id + 1) / threads, count = 0;
+            for (std::size_t i = values.size() * id / threads; i < end; i++) {
+                digest_type hash = leafHash(values[i]);
+                if(!this->update(hash, routeKey(hash), T(values[i]), true))
+                    continue;
+                if constexpr (std::is_pointer_v<T>)
+                    values[i] = nullptr;
+                count++;
+            }
+            taken += count;
+        };
+        std::vector<std::thread> workers;
+        for (unsigned int id = 1; id < threads; id++)
+            workers.push_back(std::thread(work, id));
+        work(0);
+        for (std::thread &t : workers)
+            t.join();
+        if(!this->lazy)
+            this->flush(threads);
+        return taken.load();
     };
     
-    // Removes a value into the tree
-    void remove(T v) {
-        std::string* hash = new std::string(hashFunc(std::to_string(v)));
-        size_t key = gen_key(*hash);
-        // TODO: this is probably wrong, will need to debug later
-        T temp = NULL;
-        this->update("", key, temp);
+    // Removes a value from the tree, returns false if it was not in the tree
+    bool remove(const T& v) {
+        digest_type hash = leafHash(v);
+        return this->erase(hash, routeKey(hash));
     };
     
     // TODO: This function will require a lot of thought as it will likely have to be blocking. I want to have
@@ -72,15 +187,61 @@ public:
     //          validate operation.
     bool validate();
     
+    /**
+     * Lazy hashing. While enabled, updates only mark the nodes on their path dirty and the digests are recomputed the
+     * next time the root is read or the tree is validated, dirty subtrees are rehashed by up to threads workers.
+     * Turning it off recomputes everything that is still dirty. Switch modes while no updates are running.
+     */
+    void setLazy(bool lazy, unsigned int threads = std::thread::hardware_concurrency()) {
+        this->lazy = lazy;
+        this->flushThreads = std::max(1u, threads);
+        if(!lazy)
+            this->flush(this->flushThreads);
+    };
+    
     // checks if a value is in the tree.
-    bool contains(T val) {
-        std::string hash = hashFunc(std::to_string(*val));
-        size_t key = gen_key(hash);
-        return this->contains(hash, key);
+    bool contains(const T& val) {
+        digest_type hash = leafHash(val);
+        return this->contains(hash, routeKey(hash));
     };
     
-    // returns the value of the root hash
-    std::string getRootValue() { return *(root.load()->hash.load()); };
+    /**
+     * Checks a batch of values, found[i] is set to whether values[i] is in the tree. The lookups are walked down in
+     * groups of LOOKUP_GROUP, one level of each in turn, and the node each one moves to is prefetched, so the cache
+     * misses of a group overlap instead of being waited out one after the other.
+     */
+    void contains_many(std::span<const T> values, std::vector<bool>& found);
+    
+    /**
+     * Collects the sibling digests of a value from its leaf up to the root. Writers are never waited for: the route is
+     * walked once and the proof only kept if the digests it read below the shard root (the root without shards) add up
+     * to the one stored there, otherwise a writer got in between and the walk is repeated, up to attempts times. Nothing
+     * if the value is not in the tree or every walk was overtaken, contains tells the two apart. The proof leads to the
+     * root getRootValue would return after a flush reading the same shard roots. With lazy updates only the route is
+     * brought up to date, the subtrees off it count with the digests their last flush left.
+     */
+    std::optional<Proof> prove(const T& val, unsigned int attempts = PROOF_ATTEMPTS) {
+        digest_type hash = leafHash(val);
+        return this->prove(hash, routeKey(hash), attempts);
+    };
+    
+    // Checks that proof leads to root (as getRootValue returns it), only the policy of the tree is needed.
+    static bool verify(const Proof& proof, const std::string& root, const HashPolicy& policy = HashPolicy()) {
+        std::optional<digest_type> digest = proofRoot(proof, policy);
+        return digest && digest->hex() == root;
+    };
+    
+    // verify, and that proof is about value
+    static bool verify(const T& value, const Proof& proof, const std::string& root,
+                       const HashPolicy& policy = HashPolicy()) {
+        return serializeHash(policy, value) == proof.leaf && verify(proof, root, policy);
+    };
+    
+    // returns the value of the root hash, the hex string is only built here at the API boundary
+    std::string getRootValue() {
+        this->flush(this->flushThreads);
+        return root.load()->hash.load().hex();
+    };
     
     // prints all DATA Nodes in postorder traversal. (Mainly for debugging)
     void print_values() { print_values(this->root.load()); }
@@ -88,22 +249,441 @@ public:
 
 private:
     // root node
-    std::atomic<MerkleNode*> root;
+    std::atomic<HashNode*> root;
+    
+    // hash policy, used for both leaf values and interior nodes
+    HashPolicy hashPolicy;
+    
+    // memory unlinked by one thread is handed to the reclaimer instead of being deleted while others may read it
+    Reclaimer reclaimer;
     
-    // hash function
-    std::string (*hashFunc)(std::string);
+    // lazy hashing state, see setLazy. Flushes are serialized by flushLock.
+    bool lazy = false;
+    unsigned int flushThreads = 1;
+    std::mutex flushLock;
+    
+    // number of permanent top levels, the shard roots sit at this depth
+    const unsigned int shardLevels;
+    std::vector<HashNode*> shards;
     
     // hashing function to generate node keys
-    std::hash<std::string> gen_key;
+    std::hash<std::string_view> gen_key;
+    
+    typedef typename Reclaimer::Guard Guard;
     
-    // The update function performs both inserts and removes depending on the parameters.
-    void update(std::string* hash, size_t key, T &val);
+    // key bits routed on per level
+    static constexpr unsigned int RADIX_BITS = std::countr_zero(Radix);
+    
+    /**
+     * Guard slots. Every node on the path of an operation stays protected until the operation ends, the node at depth
+     * d sits in pathSlot(d) and a second node of the same level (a new intermediary node) in the slot after. The
+     * children of the one node an operation is looking at as a whole (to hash it, or to see what is left of it) sit
+     * in CHILD_SLOT + i.
+     * A child is only retired after the descriptor of its parent changed (the parent is frozen when it is unlinked
+     * itself), so a child loaded from a protected node is safe once that descriptor is found unchanged afterwards.
+     */
+    static const unsigned int DESC_SLOT = 0;        // the descriptor of walker
+    static const unsigned int OWN_SLOT = 1;         // a descriptor being installed by this thread
+    static const unsigned int EXPECTED_SLOT = 2;    // finishOp, the child a descriptor expects to replace
+    static const unsigned int PARENT_SLOT = 3;      // helpCollapse, the parent of the frozen node
+    static const unsigned int PARENT_DESC_SLOT = 4; // helpCollapse, the descriptor of that parent
+    static const unsigned int COLLAPSE_SLOT = 5;    // helpCollapse, the COLLAPSE descriptor being installed
+    static const unsigned int SEARCH_SLOT = 6;      // helpCollapse, taking turns with PARENT_SLOT on the way down
+    static const unsigned int SEAL_SLOT = 7;        // seal, the child of the frozen node it is looking at
+    static const unsigned int CHILD_SLOT = 8;       // the children of a node, Radix slots
+    static constexpr unsigned int pathSlot(unsigned int depth) { return CHILD_SLOT + Radix + 2 * depth; };
+    // deepest level a DATA node can sit at, one per key digit. Levels grow down a path, so it also bounds its length.
+    static const unsigned int MAX_DEPTH = (Mode == KeyMode::DIGEST_BITS ? 8 * digest_type::SIZE : 64) / RADIX_BITS;
+    static_assert(Guard::SLOTS > pathSlot(MAX_DEPTH + 1) + 1, "reclaimer guards need a slot for every level of a path");
+    // lookups contains_many walks at the same time, lookup j of a group keeps its node in lookupSlot(j) and the one it
+    // moves to in the slot after, taking turns
+    static const unsigned int LOOKUP_GROUP = 16;
+    static constexpr unsigned int lookupSlot(unsigned int j) { return CHILD_SLOT + 2 * j; };
+    static_assert(Guard::SLOTS > lookupSlot(LOOKUP_GROUP), "reclaimer guards need two slots for every lookup of a group");
+    // times rehash yields to the claimed rehash of another thread before computing the digest itself, see rehash
+    static const unsigned int CLAIM_SPINS = 64;
+    // walks prove makes by default before it gives up on a route writers keep changing
+    static const unsigned int PROOF_ATTEMPTS = 16;
+    // 2^16 shard roots at most
+    static constexpr unsigned int MAX_SHARD_BITS = 16;
+    // returned by rehash when the changed child has been moved below a new node by a split, never a version (even)
+    static const std::uint64_t MOVED = 1;
+    // HashNode keeps the fields its walkers read and the ones its rehashers write on separate lines of this size
+    static constexpr std::size_t CACHE_LINE = 64;
+    // whether the policy hashes many messages of the same length at once, see HashPolicy.h
+    static constexpr bool HASH_MANY = requires(const HashPolicy& policy) { policy.hashMany(nullptr, 0u, 0u, nullptr); };
+    // Whether build and flush hash in batches, only worth it when hashMany hashes messages side by side. The batches
+    // of validate are its own.
+    bool batching() const {
+        if constexpr (HASH_MANY)
+            return this->hashPolicy.lanes() > 1;
+        return false;
+    };
+    // whether a guard keeps everything it reaches alive until it ends, so a flush can hold on to a whole subtree
+    static constexpr bool GUARD_PROTECTS_ALL = Guard::SLOTS == ~0u;
+    // leaves build hashes with one hashMany call, a multiple of the widest kernel
+    static const unsigned int LEAF_BATCH = 64;
+    // nodes of a level flushLevels rehashes together at most, see flushLevels
+    static const unsigned int FLUSH_WIDTH = 256;
+    // leaves below a node build hashes with the rest of its subtree in batches, see buildChildren
+    static const std::ptrdiff_t BUILD_PIECE = 1024;
+    
+    // hashes the canonical bytes of a value (see MerkleSerializer) into its leaf digest
+    digest_type leafHash(const T& value) const { return serializeHash(this->hashPolicy, value); };
+    
+    // generates the routing key of a leaf from its digest
+    key_type routeKey(const digest_type& hash) const {
+        if constexpr (Mode == KeyMode::DIGEST_BITS)
+            return key_type(hash);
+        else
+            return this->gen_key(std::string_view((const char*) hash.bytes, digest_type::SIZE));
+    };
+    
+    // the child a key routes to at depth, nodes do not store their key so it is rebuilt from the digest on a split
+    static unsigned int routeDigit(const key_type& key, unsigned int depth) {
+        if constexpr (Mode == KeyMode::DIGEST_BITS)
+            return (key >> depth * RADIX_BITS) % Radix;
+        else
+            return depth * RADIX_BITS < 64 ? (key >> depth * RADIX_BITS) % Radix : 0;
+    };
+    
+    // the first level in [from, to) at which keys a and b route to different children, to if there is none
+    static unsigned int divergence(const key_type& a, const key_type& b, unsigned int from, unsigned int to) {
+        while(from < to && routeDigit(a, from) == routeDigit(b, from))
+            from++;
+        return from;
+    };
+    
+    // whether key shares the digits child skipped below a parent at level, a key that does not is not below child
+    static bool onRoute(const key_type& key, HashNode* child, unsigned int level) {
+        return divergence(key, child->prefix, level + 1, child->level) == child->level;
+    };
+    
+    // The update function inserts a value, false if an equal one is already in the tree, erase removes one. With defer
+    // the path is only marked dirty, see setLazy.
+    bool update(const digest_type& hash, key_type key, T&& val, bool defer);
+    bool erase(const digest_type& hash, key_type key);
+    
+    // Freezes node and swaps it for what is left of it in parent, see erase.
+    bool collapse(HashNode* parent, HashNode* node, Descriptor* currentDesc, MerkleNode* removed, Guard& guard);
     
     // finishOp allows other executing threads to help finish the operation
-    void finishOp(Descriptor* job);
+    void finishOp(Descriptor* job, Guard& guard);
+    
+    // completes the collapse a FREEZE descriptor stands for
+    void helpCollapse(Descriptor* freeze, Guard& guard);
+    
+    // seals the empty slots of a frozen node and returns what replaces it, published in freeze->child
+    MerkleNode* seal(Descriptor* freeze, Guard& guard);
+    
+    // fills the empty slots of frozen nodes, routes and hashes like any EMPTY node but is never retired
+    static MerkleNode* sealed() {
+        static MerkleNode node(EMPTY);
+        return &node;
+    };
+    
+    // rehashes the nodes of the path of key (path[d] at depth d) bottom up, or with defer only marks them dirty. A new
+    // node current at the bottom went in with an up to date digest and is not hashed again.
+    void rehashPath(std::vector<HashNode*>& path, const key_type& key, Guard& guard, bool defer,
+                    HashNode* current = nullptr);
+    
+    /**
+     * Extends path, whose node path[j] is protected in pathSlot(depth + j), down the route of key through HASH nodes.
+     * Stops at target, or with no target at the last HASH node on the route. Returns false if target is not on the
+     * route or a frozen node is in the way, which is helped out of the tree first.
+     */
+    bool extendPath(std::vector<HashNode*>& path, unsigned int depth, const key_type& key, HashNode* target,
+                    Guard& guard);
+    
+    // replaces path with the HASH nodes on the route of key from the root, see extendPath
+    void findPath(std::vector<HashNode*>& path, const key_type& key, Guard& guard) {
+        do {
+            path.assign(1, guard.protect(this->root, pathSlot(0)));
+        } while(!extendPath(path, 0, key, nullptr, guard));
+    };
     
     // underlying contains operation, it generates the hash / key we are looking for
-    bool contains(std::string hash, std::size_t key);
+    bool contains(const digest_type& hash, key_type key);
+    
+    // underlying prove operation
+    std::optional<Proof> prove(const digest_type& hash, key_type key, unsigned int attempts);
+    
+    // the digest of a node whose children are the count siblings with digest at position among them
+    static digest_type combineLevel(const HashPolicy& policy, const digest_type& digest, const digest_type* siblings,
+                                    unsigned int count, unsigned int position) {
+        digest_type digests[Radix];
+        std::copy(siblings, siblings + position, digests);
+        digests[position] = digest;
+        std::copy(siblings + position, siblings + count, digests + position + 1);
+        return combine(policy, digests, count + 1);
+    };
+    
+    // the root digest proof leads to, nothing if its levels do not fit its siblings or Radix
+    static std::optional<digest_type> proofRoot(const Proof& proof, const HashPolicy& policy) {
+        digest_type digest = proof.leaf;
+        std::size_t next = 0;
+        for (const typename Proof::Level& level : proof.levels) {
+            if(level.count >= Radix || level.position > level.count || proof.siblings.size() - next < level.count)
+                return std::nullopt;
+            digest = combineLevel(policy, digest, proof.siblings.data() + next, level.count, level.position);
+            next += level.count;
+        }
+        if(next != proof.siblings.size())
+            return std::nullopt;
+        return digest;
+    };
+    
+    // hashes the concatenation of the child digests of an interior node at level, versions gets the version each was
+    // read at
+    digest_type hashChildren(unsigned int level, MerkleNode* const* children, std::uint64_t* versions = nullptr);
+    
+    // The digest child adds to a node at level. A HASH child further down stands in for the chain of single child
+    // nodes the uncompressed tree has in between. Its digest is lifted through them when it is written (see
+    // HashNode::hash), it only has to be lifted here if a split put the child below a new parent since.
+    digest_type childDigest(MerkleNode* child, unsigned int level, std::uint64_t& version) const {
+        if(child->type == DATA) {
+            version = 0;
+            return leaf(child)->hash;
+        }
+        digest_type lifted;
+        std::uint64_t top;
+        digest_type digest = interior(child)->hash.load(version, lifted, top);
+        if(top == level + 1)
+            return lifted;
+        return lift(digest, level + 1, interior(child)->level);
+    };
+    
+    // a digest hashed again once for every single child level in [top, level), see childDigest
+    digest_type lift(digest_type digest, unsigned int top, unsigned int level) const {
+        for (; top < level; top++)
+            digest = this->hashPolicy.combine(digest);
+        return digest;
+    };
+    
+    // sets the digest of a node that has not been published yet, top is the level below its parent
+    void initDigest(HashNode* node, const digest_type& digest, unsigned int top) const {
+        node->hash.init(digest, lift(digest, top, node->level), top);
+    };
+    
+    // the level below the parent of path[d], the root has none and is not lifted
+    static unsigned int topOf(const std::vector<HashNode*>& path, std::size_t d) {
+        return d == 0 ? path[0]->level : path[d - 1]->level + 1;
+    };
+    
+    // hashes the concatenation of count digests, for one or two the same as the policy's combine
+    static digest_type combine(const HashPolicy& policy, const digest_type* digests, unsigned int count) {
+        if(count == 0)
+            return digest_type();
+        if(count == 1)
+            return policy.combine(digests[0]);
+        if(count == 2)
+            return policy.combine(digests[0], digests[1]);
+        auto hasher = policy.hasher();
+        for (unsigned int i = 0; i < count; i++)
+            hasher.update(std::as_bytes(std::span(digests[i].bytes)));
+        return hasher.finalize();
+    };
+    
+    digest_type combine(const digest_type* digests, unsigned int count) const {
+        return combine(this->hashPolicy, digests, count);
+    };
+    
+    /**
+     * Recomputes the digest of a HASH node from its children, the caller keeps node protected, and lifts it for a
+     * parent whose level is below top (see childDigest). Returns
+     * the version written, or 0 if there is nothing left to propagate: node is frozen, or a write of its parent
+     * already folded in version changedVersion of its child changed (see MerkleNode::folded). MOVED if a split put a
+     * new node between node and changed, which has to be rehashed first. A thread carrying a changed child claims the
+     * version it builds on first and lets a rehash claimed by another thread finish.
+     */
+    std::uint64_t rehash(HashNode* node, unsigned int top, Guard& guard, HashNode* changed = nullptr,
+                         std::uint64_t changedVersion = 0);
+    
+    // raises the folded version of every HASH child to the version of it a write of their parent just included
+    static void fold(MerkleNode* const* children, const std::uint64_t* versions) {
+        for (unsigned int i = 0; i < Radix; i++) {
+            if(children[i] == nullptr || children[i]->type != HASH)
+                continue;
+            std::atomic<std::uint64_t>& childFolded = interior(children[i])->folded;
+            std::uint64_t folded = childFolded.load();
+            while(folded < versions[i] && !childFolded.compare_exchange_weak(folded, versions[i]));
+        }
+    };
+    
+    // recomputes every dirty node with up to threads workers and the root from the shards, see setLazy
+    void flush(unsigned int threads);
+    
+    // creates the permanent levels from depth down to the shard roots, which are collected in shards
+    HashNode* buildTop(unsigned int depth);
+    
+    // flushes the dirty shards below a permanent node at depth, which no guard needs to protect
+    void flushTop(HashNode* node, unsigned int depth, Guard& guard, unsigned int threads);
+    
+    // what a permanent node stands for in the tree without shards: nothing (EMPTY), a single value (DATA) or a HASH node
+    struct Summary {
+        digest_type hash;
+        NodeType type;
+    };
+    
+    // combines the permanent levels below node at depth bottom up, the root digest when node is the root. With fresh
+    // every level is combined again and nothing is cached.
+    Summary summarize(HashNode* node, unsigned int depth, Guard& guard, bool fresh = false);
+    
+    // marks the permanent nodes above the shard root of path dirty, bottom up, see summarize
+    void markTop(const std::vector<HashNode*>& path) {
+        for (std::size_t d = this->shardLevels; d-- > 0;) {
+            if(!path[d]->dirty.load())
+                path[d]->dirty.store(true);
+        }
+    };
+    
+    // rehashes the dirty part of the subtree below a node whose dirty flag the caller already cleared, node is
+    // protected in pathSlot(depth) of guard and top is the level below its parent
+    void flushSubtree(HashNode* node, unsigned int top, unsigned int depth, Guard& guard, unsigned int threads);
+    
+    // flushSubtree for child i of node, which was child when the caller cleared its dirty flag
+    void flushChild(HashNode* node, unsigned int i, HashNode* child, unsigned int depth, Guard& guard,
+                    unsigned int threads);
+    
+    // rehashes the nodes a split put between node at depth and child since the caller cleared the dirty flag of child,
+    // which was child i of node then, see flushChild
+    void rehashMoved(HashNode* node, unsigned int i, HashNode* child, unsigned int depth, Guard& guard);
+    
+    // a node flushLevels rehashes, child i of parent when its dirty flag was cleared (none for the node the flush
+    // starts from), top is the level below parent
+    struct Flushed {
+        HashNode* node;
+        HashNode* parent;
+        unsigned int i;
+        unsigned int top;
+    };
+    
+    // flushSubtree for a single worker whose guard protects the whole subtree, from nodes of the same level at depth
+    // whose flags are cleared. The flags are cleared one level at a time top down and then each level is rehashed at
+    // once with rehashMany, bottom up.
+    void flushLevels(std::vector<Flushed> nodes, unsigned int depth, Guard& guard);
+    
+    // rehash without a changed child for every node of a level, see hashChildrenMany
+    void rehashMany(const std::vector<Flushed>& nodes, Guard& guard);
+    
+    // a node hashChildrenMany hashes with the children it was read with, top is the level below its parent
+    struct Read {
+        HashNode* node;
+        unsigned int top;
+        bool frozen = false;
+        MerkleNode* children[Radix] = {};
+        std::uint64_t versions[Radix] = {};
+        digest_type digest = digest_type();
+        digest_type lifted = digest_type();
+    };
+    
+    // Sets the digest of every node that is not frozen as hashChildren would, and the digest lifted to top, along with
+    // the versions of the children. The nodes with the same number of children are hashed with one hashMany call.
+    void hashChildrenMany(std::vector<Read>& reads) const;
+    
+    /**
+     * Runs work(i, threads, spawned) for every i in [0, count). The items are split into up to threads contiguous
+     * groups, every group but the first runs on a new thread (spawned) and the threads are shared out between the
+     * groups, so work can split its share again.
+     */
+    template<typename Work>
+    static void forkJoin(unsigned int count, unsigned int threads, Work work) {
+        unsigned int groups = std::min(count, std::max(1u, threads));
+        std::vector<std::thread> workers;
+        for (unsigned int g = groups; g-- > 0;) {
+            unsigned int first = count * g / groups, last = count * (g + 1) / groups;
+            unsigned int share = std::max(1u, threads * (g + 1) / groups - threads * g / groups);
+            auto run = [first, last, share, spawned = g != 0, &work]() {
+                for (unsigned int i = first; i < last; i++)
+                    work(i, share, spawned);
+            };
+            if(g == 0)
+                run();
+            else
+                workers.push_back(std::thread(run));
+        }
+        for (std::thread &t : workers)
+            t.join();
+    };
+    
+    // a value of build() with its digest, routing key and position in the input, and whether it went into the tree
+    struct Leaf {
+        digest_type hash;
+        key_type key;
+        T val;
+        std::size_t index;
+        bool taken;
+    };
+    
+    // builds the subtree of the leaves in [first, last), which share the routing digits above level, see build
+    MerkleNode* buildSubtree(Leaf* first, Leaf* last, unsigned int level, unsigned int threads);
+    // builds the children of a HASH node from its leaves and hashes it, top is the level below its parent
+    void buildChildren(HashNode* node, Leaf* first, Leaf* last, unsigned int top, unsigned int threads);
+    
+    // hashes the nodes of the subtrees below roots that build put together, see buildChildren
+    void hashPieces(std::vector<Read> roots);
+    
+    // Sets the digest of the leaves in [first, last). When batching and the values have a view() of their encoding
+    // (see MerkleSerializer) runs of encodings of the same length are hashed LEAF_BATCH at a time.
+    void leafHashes(Leaf* first, Leaf* last) const {
+        typedef MerkleSerializer<T> serializer;
+        if constexpr (HASH_MANY && requires(const T& v) { serializer::view(v); }) {
+            const unsigned char* messages[LEAF_BATCH];
+            digest_type digests[LEAF_BATCH];
+            while(first != last && batching()) {
+                std::size_t len = serializer::view(first->val).size();
+                unsigned int count = 0;
+                for (; first + count != last && count < LEAF_BATCH; count++) {
+                    std::span<const std::byte> bytes = serializer::view(first[count].val);
+                    if(bytes.size() != len)
+                        break;
+                    messages[count] = reinterpret_cast<const unsigned char*>(bytes.data());
+                }
+                this->hashPolicy.hashMany(messages, (unsigned int) len, count, digests);
+                for (unsigned int j = 0; j < count; j++)
+                    first[j].hash = digests[j];
+                first += count;
+            }
+        }
+        for (; first != last; first++)
+            first->hash = leafHash(first->val);
+    };
+    
+    // the node type behind a MerkleNode, see its type
+    static LeafNode* leaf(MerkleNode* node) { return static_cast<LeafNode*>(node); };
+    static HashNode* interior(MerkleNode* node) { return static_cast<HashNode*>(node); };
+    
+    // what a HASH node keeps of the key of a value with digest hash
+    static prefix_type prefixOf(const digest_type& hash, const key_type& key) {
+        if constexpr (Mode == KeyMode::DIGEST_BITS)
+            return hash;
+        else
+            return key;
+    };
+    
+    // deleter of unlinked nodes of any type, the value of a DATA node stays with its copy, see collapse
+    static void deleteNode(void* p) {
+        MerkleNode* node = static_cast<MerkleNode*>(p);
+        if(node->type == HASH)
+            delete interior(node);
+        else if(node->type == DATA)
+            delete leaf(node);
+        else
+            delete node;
+    };
+    
+    // frees what a stored value owns beyond the leaf, the pointee of a pointer T
+    static void release(T& val) {
+        if constexpr (std::is_pointer_v<T>)
+            delete val;
+    };
+    
+    // deleter of removed DATA nodes, the tree owns the values it stores
+    static void deleteLeaf(void* p) {
+        LeafNode* node = static_cast<LeafNode*>(p);
+        release(node->val);
+        delete node;
+    };
     
     /**
     * This function does a postorder traversal of the tree and deallocates the used memory.
@@ -111,12 +691,13 @@ private:
     */
     void post_delete(MerkleNode* node) {
         if (node != nullNode) {
-            post_delete(node->left.load());
-            post_delete(node->right.load());
-            delete node->hash.load();
+            if(node->type == HASH) {
+                for (std::atomic<MerkleNode*>& child : interior(node)->children)
+                    post_delete(child.load());
+            }
             if(node->type == DATA)
-                delete node->val;
-            delete node;
+                release(leaf(node)->val);
+            deleteNode(node);
         }
     };
     
@@ -126,10 +707,15 @@ private:
      */
     void print_values(MerkleNode* node) {
         if (node != nullNode) {
-            print_values(node->left.load());
-            print_values(node->right.load());
+            if(node->type == HASH) {
+                for (std::atomic<MerkleNode*>& child : interior(node)->children)
+                    print_values(child.load());
+            }
             if(node->type == DATA) {
-                std::cout << *(node->val) << std::endl;
+                if constexpr (std::is_pointer_v<T>)
+                    std::cout << *(leaf(node)->val) << std::endl;
+                else
+                    std::cout << leaf(node)->val << std::endl;
             }
         }
     };
@@ -140,58 +726,85 @@ private:
 * This class handles induvidual nodes within the merkle tree. Most items have been left as public for ease of use.
 * However, because this is a protected class, and the MerkleTree object only contains a MerkleNode as a private variable
 * nothing in this class can be modified by the user.
+* A MerkleNode is only the type every node starts with, an EMPTY node is nothing more. DATA nodes are LeafNodes and
+* HASH nodes are HashNodes, a walker reads the type before it looks at anything else.
 */
-template<typename T>
-class MerkleTree<T>::MerkleNode {
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+class MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::MerkleNode {
+public:
+    // HASH, DATA or EMPTY, a HASH node points to other nodes, and its value is the hash(child_hash_0 + ... child_hash_N)
+    NodeType type;
+    
+    MerkleNode(NodeType _type = EMPTY) {
+        this->type = _type;
+    };
+    
+    // Nodes of every type come from the per-thread arena. Deleting through a MerkleNode* is only done for EMPTY nodes,
+    // the others are deleted as their own type (see deleteNode) so the size matches the allocation.
+    static void* operator new(std::size_t size) { return NodeArena::allocate(size); };
+    static void operator delete(void* p, std::size_t size) { NodeArena::deallocate(p, size); };
+};
+
+// A DATA node, the value and its digest, neither of which changes. Small enough to share a cache line with others.
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+class MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::LeafNode : public MerkleNode {
 public:
+    // The binary digest is stored inline
+    digest_type hash;
     // What is stored by the tree
     T val;
-    // the "key" is the remaining path in the tree, as intermediary nodes are added this determines left/right
-    std::size_t key;
-    // HASH or DATA, a HASH node points to other HASH or DATA nodes, and its value is the hash(child_hash_0 + ... child_hash_N)
-    NodeType type;
-    std::atomic<std::string*> hash;
+    
+    LeafNode(const digest_type& _hash, T&& v) : MerkleNode(DATA), hash(_hash), val(std::move(v)) {};
+    
+    LeafNode(const digest_type& _hash, const T& v) : MerkleNode(DATA), hash(_hash), val(v) {};
+};
+
+/**
+ * A HASH node. What a walker reads on its way down (the type, level, descriptor, children and prefix) comes first,
+ * the digest and the bookkeeping of the threads that rehash it, written by every update below the node, start on a
+ * cache line of their own so rehashing a node does not take the lines its walkers read away from them.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+class MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::HashNode : public MerkleNode {
+public:
+    // The level whose digit picks the child, the level below the parent unless the single child levels in between
+    // were compressed away. Every key below the node has the same digits there as prefix, the key of the value the
+    // node was created for. Neither changes once the node is published.
+    unsigned int level;
     // The description of a pending operation on this node, other threads can help complete it.
     std::atomic<Descriptor*> desc;
-    std::atomic<MerkleNode*> left;
-    std::atomic<MerkleNode*> right;
+    std::atomic<MerkleNode*> children[Radix];
+    prefix_type prefix;
     
-    MerkleNode(std::string* _hash, T &v) {
-        this->val = v;
-        this->hash.store(_hash);
-        this->type = DATA;
-        this->desc.store(nullptr);
-        this->left.store(nullptr);
-        this->right.store(nullptr);
-    };
+    // The digest, replaced after every update below the node. It is stored lifted through the levels the node skips
+    // below its parent as well, tagged with the level below the parent, so the parent reads it with no hashing. A
+    // permanent node above the shard roots keeps its summary here instead, tagged with its type (see summarize).
+    alignas(CACHE_LINE) AtomicDigest<digest_type::SIZE> hash;
+    // The digest is stale and the node or a descendant needs rehashing (lazy mode only), for a permanent node above
+    // the shard roots it is the summary
+    std::atomic<bool> dirty;
+    // The highest version of hash a successful write of the parent has been computed from. Versions of a node only
+    // grow and parent writes read them in order, so everything up to folded is already carried up by that writer.
+    std::atomic<std::uint64_t> folded;
+    // version + 1 of hash while a thread is computing the digest that replaces that version, advisory only
+    std::atomic<std::uint64_t> claim;
     
-    MerkleNode(std::string* _hash, size_t key, T &v) {
-        this->val = v;
-        this->hash.store(_hash);
-        this->key = key;
-        this->type = DATA;
+    HashNode(unsigned int _level, const prefix_type& _prefix) : MerkleNode(HASH), prefix(_prefix) {
+        this->level = _level;
+        this->dirty.store(false);
+        this->folded.store(0);
+        this->claim.store(0);
         this->desc.store(nullptr);
-        this->left.store(nullptr);
-        this->right.store(nullptr);
+        this->resetChildNodes();
     };
     
-    MerkleNode() {
-        this->hash.store(new std::string(""));
-        this->val = NULL;
-        this->key = 0;
-        this->type = HASH;
-        this->desc.store(nullptr);
-        this->left.store(nullptr);
-        this->right.store(nullptr);
-    };
-    
-    ~MerkleNode() {
+    ~HashNode() {
         delete this->desc.load();
     };
     
     void resetChildNodes() {
-        this->left.store(nullptr);
-        this->right.store(nullptr);
+        for (std::atomic<MerkleNode*>& child : this->children)
+            child.store(nullptr);
     }
 };
 
@@ -200,338 +813,1572 @@ public:
 * This class is used to describe pending operations that need to occur. Typically Descriptor objects are needed 
 * when multiple words need to be atomically modified atomically.
 */
-template<typename T>
-class MerkleTree<T>::Descriptor
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+class MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::Descriptor
 {
 public:
-    // Whether the operation has been completed
-    bool pending;
-    // We have two types of operations, HASH node, and DATA node, there may be additional ones for remove.
-    // For each of these, the operation is slightly different.
-    NodeType typeOp;
-    MerkleNode* parent;
+    // Whether the operation has been completed, for FREEZE whether the collapse has been completed
+    std::atomic<bool> pending;
+    // All operations but FREEZE swap oldChild for child in the dir slot of parent, see OpType. A FREEZE descriptor
+    // sits on the frozen node (oldChild) and describes the COLLAPSE still to be done on its parent, parent is where
+    // the node was frozen, splits may have moved it further down since. Its child is the replacement, published by
+    // seal, and dir the slot of the child removed with the node (Radix if none).
+    OpType typeOp;
+    HashNode* parent;
     MerkleNode* oldChild;
-    MerkleNode* child;
-    Direction dir;
-    size_t key;
+    std::atomic<MerkleNode*> child;
+    unsigned int dir;
     
     
     Descriptor() {
         this->pending = true;
-        this->typeOp = HASH;
+        this->typeOp = INSERT_HASH;
     };
     
-    Descriptor(MerkleNode* _parent, MerkleNode* _child, MerkleNode* _oldChild, Direction _dir, size_t _key) {
+    Descriptor(HashNode* _parent, MerkleNode* _child, MerkleNode* _oldChild, unsigned int _dir) {
         this->pending = true;
-        this->typeOp = HASH;
+        this->typeOp = INSERT_HASH;
         this->parent = _parent;
         this->child = _child;
         this->oldChild = _oldChild;
         this->dir = _dir;
-        this->key = _key;
     };
     
-    Descriptor(MerkleNode* _child) {
+    Descriptor(OpType _typeOp, HashNode* _parent, MerkleNode* _child, MerkleNode* _oldChild, unsigned int _dir) {
         this->pending = true;
-        this->typeOp = DATA;
+        this->typeOp = _typeOp;
+        this->parent = _parent;
         this->child = _child;
+        this->oldChild = _oldChild;
+        this->dir = _dir;
     };
     
     ~Descriptor() {};
     
-    void setDataDescriptor(MerkleNode* _parent, Direction _dir) {
-        this->parent = _parent;
-        this->dir = _dir;
-    };
+    static void* operator new(std::size_t size) { return NodeArena::allocate(size); };
+    static void operator delete(void* p, std::size_t size) { NodeArena::deallocate(p, size); };
     
-    void setHashDescriptor(MerkleNode* _parent, MerkleNode* _child, MerkleNode* _oldChild, Direction _dir, size_t _key) {
+    void setHashDescriptor(HashNode* _parent, MerkleNode* _child, MerkleNode* _oldChild, unsigned int _dir) {
         this->parent = _parent;
         this->child = _child;
         this->oldChild = _oldChild;
         this->dir = _dir;
-        this->key = _key;
     };
 private:
 };
 
-template<typename T>
-void MerkleTree<T>::update(std::string* hash, std::size_t key, T &val) {
-    // walks through the tree
-    MerkleNode* walker = this->root.load();
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+template<std::ranges::random_access_range Range>
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>*
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::build(Range&& values, unsigned int threads, HashPolicy policy,
+                                                         unsigned int shardBits) {
+    MerkleTree* tree = new MerkleTree(policy, shardBits);
+    std::size_t count = std::ranges::size(values);
+    threads = (unsigned int) std::clamp<std::size_t>(count, 1, std::max(1u, threads));
+    
+    std::vector<Leaf> leaves(count);
+    auto hashLeaves = [tree, &values, &leaves, count, threads](unsigned int id) {
+        std::size_t begin = count * id / threads, end = count * (id + 1) / threads;
+        for (std::size_t i = begin; i < end; i++) {
+            leaves[i].val = std::ranges::begin(values)[i];
+            leaves[i].index = i;
+            leaves[i].taken = false;
+        }
+        tree->leafHashes(leaves.data() + begin, leaves.data() + end);
+        for (std::size_t i = begin; i < end; i++)
+            leaves[i].key = tree->routeKey(leaves[i].hash);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int id = 1; id < threads; id++)
+        workers.push_back(std::thread(hashLeaves, id));
+    hashLeaves(0);
+    for (std::thread &t : workers)
+        t.join();
+    
+    // the root and the top levels are HASH nodes whatever they hold, below them a HASH node only exists where two
+    // leaves part ways
+    tree->buildChildren(tree->root.load(), leaves.data(), leaves.data() + count, 0, threads);
+    if constexpr (std::is_pointer_v<T>) {
+        for (const Leaf& leaf : leaves) {
+            if(leaf.taken)
+                std::ranges::begin(values)[leaf.index] = nullptr;
+        }
+    }
+    return tree;
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+typename MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::MerkleNode*
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::buildSubtree(Leaf* first, Leaf* last, unsigned int level, unsigned int threads) {
+    if(first == last)
+        return nullptr;
+    if(last - first == 1) {
+        first->taken = true;
+        return new LeafNode(first->hash, std::move(first->val));
+    }
+    
+    // leaves with the same digest are the same value and would never split up, the first in input order is kept
+    if(std::all_of(first + 1, last, [first](const Leaf& leaf) { return leaf.hash == first->hash; })) {
+        Leaf* kept = std::min_element(first, last, [](const Leaf& a, const Leaf& b) { return a.index < b.index; });
+        kept->taken = true;
+        return new LeafNode(kept->hash, std::move(kept->val));
+    }
+    
+    // the node sits at the first level where its leaves part ways
+    unsigned int top = level;
+    auto together = [first, &level](const Leaf& leaf) { return routeDigit(leaf.key, level) == routeDigit(first->key, level); };
+    while(std::all_of(first + 1, last, together))
+        level++;
+    HashNode* node = new HashNode(level, prefixOf(first->hash, first->key));
+    buildChildren(node, first, last, top, threads);
+    return node;
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::buildChildren(HashNode* node, Leaf* first, Leaf* last,
+                                                                      unsigned int top, unsigned int threads) {
+    unsigned int level = node->level;
+    // sort the leaves by their digit at this level in place, bounds[i] is where the leaves of child i start
+    Leaf* bounds[Radix + 1];
+    std::size_t counts[Radix] = {};
+    for (Leaf* leaf = first; leaf != last; leaf++)
+        counts[routeDigit(leaf->key, level)]++;
+    bounds[0] = first;
+    for (unsigned int i = 0; i < Radix; i++)
+        bounds[i + 1] = bounds[i] + counts[i];
+    Leaf* next[Radix];
+    std::copy(bounds, bounds + Radix, next);
+    for (unsigned int i = 0; i < Radix; i++) {
+        while(next[i] != bounds[i + 1]) {
+            unsigned int digit = routeDigit(next[i]->key, level);
+            if(digit == i)
+                next[i]++;
+            else
+                std::swap(*next[i], *next[digit]++);
+        }
+    }
+    
+    // the children with leaves are built on up to threads workers. The children of the top levels already exist,
+    // they are filled in place and hashed by flush.
+    std::vector<unsigned int> filled;
+    for (unsigned int i = 0; i < Radix; i++) {
+        if(bounds[i] != bounds[i + 1])
+            filled.push_back(i);
+    }
+    forkJoin((unsigned int) filled.size(), threads, [this, node, level, &bounds, &filled](unsigned int j, unsigned int workers, bool) {
+        unsigned int i = filled[j];
+        if(level < this->shardLevels)
+            buildChildren(interior(node->children[i].load()), bounds[i], bounds[i + 1], level + 1, workers);
+        else
+            node->children[i].store(buildSubtree(bounds[i], bounds[i + 1], level + 1, workers));
+    });
+    if(level < this->shardLevels)
+        return;
+    if constexpr (HASH_MANY) {
+        // a node with up to BUILD_PIECE leaves is hashed with the rest of its piece by the first node above with more
+        if(batching()) {
+            if(last - first <= BUILD_PIECE && level > this->shardLevels)
+                return;
+            std::vector<Read> pieces;
+            for (unsigned int i : filled) {
+                MerkleNode* child = node->children[i].load();
+                if(child->type == HASH && bounds[i + 1] - bounds[i] <= BUILD_PIECE)
+                    pieces.push_back({interior(child), level + 1});
+            }
+            hashPieces(std::move(pieces));
+        }
+    }
+    MerkleNode* children[Radix];
+    for (unsigned int i = 0; i < Radix; i++)
+        children[i] = node->children[i].load();
+    initDigest(node, hashChildren(level, children), top);
+}
+
+/**
+ * The pieces are not in the tree yet, so their nodes are read without a guard, and written with init. The levels are
+ * collected top down and hashed bottom up like flushLevels does.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::hashPieces(std::vector<Read> roots) {
+    // levels[k] holds the nodes k levels below the roots
+    std::vector<std::vector<Read>> levels;
+    levels.push_back(std::move(roots));
+    while(true) {
+        std::vector<Read> below;
+        for (Read& above : levels.back()) {
+            for (unsigned int i = 0; i < Radix; i++) {
+                above.children[i] = above.node->children[i].load();
+                if(above.children[i] != nullptr && above.children[i]->type == HASH)
+                    below.push_back({interior(above.children[i]), above.node->level + 1});
+            }
+        }
+        if(below.empty())
+            break;
+        levels.push_back(std::move(below));
+    }
+    for (std::size_t k = levels.size(); k-- > 0;) {
+        hashChildrenMany(levels[k]);
+        for (const Read& read : levels[k])
+            read.node->hash.init(read.digest, read.lifted, read.top);
+    }
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+bool MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::update(const digest_type& hash, key_type key, T&& val, bool defer) {
+    Guard guard(this->reclaimer);
+    
+    // walks through the tree, depth is the position of walker on the path (the root is 0)
+    HashNode* walker = guard.protect(this->root, pathSlot(0));
+    unsigned int depth = 0;
     MerkleNode* next = nullptr;
     Descriptor* currentDesc;
-    std::stack<MerkleTree<T>::MerkleNode*> visited;
+    std::vector<HashNode*> visited;
 
-    // Allocate the Data node to insert
-    MerkleNode* dataNode = new MerkleNode(hash, val);
-    Descriptor* dataDesc = new Descriptor(dataNode);
+    // The Data node to insert, allocated once it is needed and reused on every retry
+    LeafNode* dataNode = nullptr;
     
     // These are used if an intermediary node is needed
-    MerkleNode* hashNode = nullptr;
+    HashNode* hashNode = nullptr;
     Descriptor* hashDesc = nullptr;
+    // the intermediary node that went in, if next did not change after its digest was computed
+    HashNode* current = nullptr;
     
-    Direction dir;
+    unsigned int dir;
     bool finished = false;
     
+    // After insertion we will need to update the hashes along the path, visited[d] is the node at depth d
+    visited.push_back(walker);
+    
     while(!finished) {
-        // After insertion we will need to update the hashes along the path. Nodes on the path are stored in the stack
-        visited.push(walker);
-        
         // Grab the current descriptor
-        currentDesc = walker->desc.load();
+        currentDesc = guard.protect(walker->desc, DESC_SLOT);
         // Finish its pending operation
-        finishOp(currentDesc);
+        finishOp(currentDesc, guard);
+        
+        // A frozen walker is being collapsed out of the tree, which finishOp just made sure of. Start over.
+        if(currentDesc != nullptr && currentDesc->typeOp == FREEZE) {
+            walker = guard.protect(this->root, pathSlot(0));
+            depth = 0;
+            visited.assign(1, walker);
+            continue;
+        }
+        
+        // Determine which child we need to traverse to and load next
+        dir = routeDigit(key, walker->level);
+        next = guard.protect(walker->children[dir], pathSlot(depth + 1));
+        if(walker->desc.load() != currentDesc)
+            continue;
+        
+        // In this function we stop if the next type is DATA or nullptr (or EMPTY).
+        // Therefore walker must be a HASH node, we can try to insert a DATA node at next
+        if(next == nullptr || next->type == EMPTY) {
+            if(dataNode == nullptr)
+                dataNode = new LeafNode(hash, std::move(val));
+            
+            /**
+             * Filling an empty slot needs no descriptor: every other operation on a slot expects a node in it, and
+             * rehashing reads the children again after this CAS. A collapse of walker seals its empty slots before it
+             * settles on what replaces walker, so the new node either fails this CAS or is carried over, see seal.
+             * A slot is only sealed once walker is frozen, next can not be the sealed node after the check above.
+             */
+            if(walker->children[dir].compare_exchange_strong(next, dataNode)) {
+                finished = true;
+                guard.retire(next, &MerkleTree::deleteNode);
+            }
+            continue;
+        }
+        
+        /**
+         * There are three cases when reaching a DATA or HASH node,
+         * 1) We are updating an existing value
+         * 2) next is a HASH node on our route, continue below it
+         * 3) Our key parts from the key of next (the prefix of a compressed HASH node) above the level next routes
+         *    on. An intermediary HASH node holding both next and the inserted node is placed between walker and next
+         *    at the level where they part, a single node however many levels they shared.
+         */
+        unsigned int level;
+        key_type nextKey;
+        if(next->type == DATA) {
+            // check if the data node is what we are inserting, a value is known by its digest (see contains)
+            if(leaf(next)->hash == hash) {
+                // nothing allocated here has been published yet, a pointer value is left to the caller
+                delete dataNode;
+                delete hashNode;
+                delete hashDesc;
+                return false;
+            }
+            // The key of next is rebuilt from its (immutable) digest.
+            nextKey = routeKey(leaf(next)->hash);
+            level = divergence(key, nextKey, walker->level + 1, MAX_DEPTH);
+        } else {
+            nextKey = key_type(interior(next)->prefix);
+            level = divergence(key, nextKey, walker->level + 1, interior(next)->level);
+            if(level == interior(next)->level) {
+                // Still have HASH nodes to traverse, set walker to next.
+                depth++;
+                walker = interior(next);
+                visited.push_back(walker);
+                continue;
+            }
+        }
+        
+        if(dataNode == nullptr)
+            dataNode = new LeafNode(hash, std::move(val));
+        // Check if we have an already allocated node
+        if(hashNode == nullptr) {
+            // Create a new node and descriptor
+            hashNode = new HashNode(level, prefixOf(hash, key));
+            hashDesc = new Descriptor(walker, hashNode, next, dir);
+        }
+        else {
+            // Clean the allocated node and reinitialize the descriptor
+            hashNode->resetChildNodes();
+            hashNode->level = level;
+            hashDesc->setHashDescriptor(walker, hashNode, next, dir);
+        }
+        hashNode->children[routeDigit(nextKey, level)].store(next);
+        hashNode->children[routeDigit(key, level)].store(dataNode);
+        // The new node goes in with its digest. A flush, or the rehash of another thread, that reaches it before this
+        // thread rehashes (or marks) it would otherwise fold an empty digest into the root.
+        MerkleNode* children[Radix] = {};
+        std::uint64_t versions[Radix];
+        children[routeDigit(nextKey, level)] = next;
+        children[routeDigit(key, level)] = dataNode;
+        initDigest(hashNode, hashChildren(level, children, versions), walker->level + 1);
+        
+        // Try to swap the new descriptor
+        guard.set(OWN_SLOT, hashDesc);
+        guard.set(pathSlot(depth + 1) + 1, hashNode);
+        if(walker->desc.compare_exchange_weak(currentDesc, hashDesc)) {
+            // finish the operation
+            finishOp(hashDesc, guard);
+            finished = true;
+            visited.push_back(hashNode);
+            // a change of next after it was read is rehashed by whoever made it, from below the new node
+            if(next->type != HASH || interior(next)->hash.version() == versions[routeDigit(nextKey, level)])
+                current = hashNode;
+            hashNode = nullptr;
+            hashDesc = nullptr;
+            
+            // now that the old descriptor has been swapped, retire it, other threads may still be helping it
+            guard.retire(currentDesc);
+            
+            /**
+             * A dirty HASH node that moved down has to be found by the next flush below the new node. A thread marking
+             * it after this check finds it moved and marks the new path itself, see rehashPath.
+             */
+            if(next->type == HASH && interior(next)->dirty.load())
+                rehashPath(visited, key, guard, true);
+        }
+    } // end while
+    
+    // whatever the tree did not take, dataNode went in one way or another
+    delete hashNode;
+    delete hashDesc;
+
+    rehashPath(visited, key, guard, defer, current);
+    return true;
+}
+
+/**
+ * Removing a DATA node keeps the tree in the shape inserting the remaining values would have given it: a HASH node
+ * other than the root is only kept while two or more values sit below it. If the parent of the removed node keeps a
+ * HASH child it stays and the node is swapped for an EMPTY one (REMOVE), otherwise the parent is frozen and replaced
+ * in its own parent by a copy of its other child (COLLAPSE). The copy is what keeps a slot from ever holding the same
+ * node twice. Collapsing can leave the grandparent with a single DATA child in turn, so it is repeated up the path.
+ * A split may have moved the frozen node below a new parent meanwhile, so the path is looked up again after each
+ * collapse, otherwise the parent the copy went into would not be rehashed.
+ * A node left with a single HASH child is kept, it hashes like the chain of single child nodes it compresses.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+bool MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::erase(const digest_type& hash, key_type key) {
+    Guard guard(this->reclaimer);
+    
+    // path[d] is the node at depth d
+    std::vector<HashNode*> path = {guard.protect(this->root, pathSlot(0))};
+    HashNode* walker;
+    MerkleNode* next;
+    MerkleNode* children[Radix] = {};
+    Descriptor* currentDesc;
+    unsigned int dir;
+    
+    while(true) {
+        walker = path.back();
+        unsigned int depth = path.size() - 1;
+        
+        currentDesc = guard.protect(walker->desc, DESC_SLOT);
+        finishOp(currentDesc, guard);
+        if(currentDesc != nullptr && currentDesc->typeOp == FREEZE) {
+            path.assign(1, guard.protect(this->root, pathSlot(0)));
+            continue;
+        }
+        
+        dir = routeDigit(key, walker->level);
+        next = guard.protect(walker->children[dir], pathSlot(depth + 1));
+        for (unsigned int i = 0; i < Radix; i++) {
+            if(i != dir)
+                children[i] = guard.protect(walker->children[i], CHILD_SLOT + i);
+        }
+        if(walker->desc.load() != currentDesc)
+            continue;
+        
+        if(next == nullptr || next->type == EMPTY)
+            return false;
         
+        if(next->type == HASH) {
+            if(!onRoute(key, interior(next), walker->level))
+                return false;
+            path.push_back(interior(next));
+            continue;
+        }
+        
+        if(leaf(next)->hash != hash)
+            return false;
         
-        // Determine which direction we need to traverse and load next based on the direction
-        switch(key % 2) {
-            case LEFT :
-                next = walker->left.load();
-                dir = LEFT;
+        // what is left of walker without next
+        MerkleNode* survivor = nullptr;
+        unsigned int remaining = 0;
+        for (unsigned int i = 0; i < Radix; i++) {
+            if(i != dir && children[i] != nullptr && children[i]->type != EMPTY) {
+                survivor = children[i];
+                remaining++;
+            }
+        }
+        
+        // the root and the shard roots always stay
+        if(depth <= this->shardLevels || remaining > 1 || (survivor != nullptr && survivor->type == HASH)) {
+            MerkleNode* empty = new MerkleNode(EMPTY);
+            Descriptor* removeDesc = new Descriptor(REMOVE, walker, empty, next, dir);
+            guard.set(OWN_SLOT, removeDesc);
+            if(walker->desc.compare_exchange_weak(currentDesc, removeDesc)) {
+                finishOp(removeDesc, guard);
+                guard.retire(currentDesc);
+                guard.retire(next, &MerkleTree::deleteLeaf);
                 break;
-            case RIGHT :
-                next = walker->right.load();
-                dir = RIGHT;
+            }
+            delete empty;
+            delete removeDesc;
+        } else {
+            if(collapse(path[depth - 1], walker, currentDesc, next, guard)) {
+                findPath(path, key, guard);
                 break;
+            }
         }
+    }
+    
+    // Collapse the ancestors left with a single DATA child (or none), up to the shard root.
+    while(path.size() > this->shardLevels + 1) {
+        walker = path.back();
+        unsigned int depth = path.size() - 1;
         
-        // In this function we stop if the next type is DATA or nullptr.
-        // Therefore walker must be a HASH node, we can try to insert a DATA node at next
-        if(next == nullptr) {
-            // set the value of the new node's key
-            dataNode->key = key >> 1;
-            dataDesc->setDataDescriptor(walker, dir);
-            if(walker->desc.compare_exchange_weak(currentDesc, dataDesc)) {
-                // TODO: is there a chance dataDesc could be removed by here?
-                finishOp(dataDesc);
-                finished = true;
-                delete currentDesc;
+        currentDesc = guard.protect(walker->desc, DESC_SLOT);
+        finishOp(currentDesc, guard);
+        // somebody else is already collapsing it
+        if(currentDesc != nullptr && currentDesc->typeOp == FREEZE)
+            break;
+        
+        for (unsigned int i = 0; i < Radix; i++)
+            children[i] = guard.protect(walker->children[i], CHILD_SLOT + i);
+        if(walker->desc.load() != currentDesc)
+            continue;
+        
+        MerkleNode* survivor = nullptr;
+        unsigned int remaining = 0;
+        for (MerkleNode* child : children) {
+            if(child != nullptr && child->type != EMPTY) {
+                survivor = child;
+                remaining++;
             }
-        } else if (next->type == DATA) {
+        }
+        if(remaining > 1 || (survivor != nullptr && survivor->type == HASH))
+            break;
+        
+        if(collapse(path[depth - 1], walker, currentDesc, nullptr, guard))
+            findPath(path, key, guard);
+    }
+    
+    rehashPath(path, key, guard, this->lazy);
+    return true;
+}
+
+/**
+ * Freezes node, whose descriptor currentDesc has been finished and whose children were read after that, and swaps it
+ * in parent for what is left of it, see seal. removed is a child that is dropped with its value. Fails if another
+ * descriptor was installed on node in the meantime. Once frozen and sealed the children of node can no longer change,
+ * node and all of them are retired here.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+bool MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::collapse(HashNode* parent, HashNode* node,
+                                                                 Descriptor* currentDesc, MerkleNode* removed,
+                                                                 Guard& guard) {
+    // removed stays in its slot until the freeze fails or succeeds, only a descriptor on node could move it
+    unsigned int dropped = Radix;
+    for (unsigned int i = 0; i < Radix; i++) {
+        if(removed != nullptr && node->children[i].load() == removed)
+            dropped = i;
+    }
+    Descriptor* freeze = new Descriptor(FREEZE, parent, nullptr, node, dropped);
+    guard.set(OWN_SLOT, freeze);
+    if(!node->desc.compare_exchange_strong(currentDesc, freeze)) {
+        delete freeze;
+        return false;
+    }
+    guard.retire(currentDesc);
+    helpCollapse(freeze, guard);
+    
+    // the replacement holds copies of the values left. The FREEZE descriptor goes with node, it is only read through
+    // node.
+    for (std::atomic<MerkleNode*>& slot : node->children) {
+        MerkleNode* child = slot.load();
+        if(child == sealed())
+            continue;
+        if(child == removed)
+            guard.retire(child, &MerkleTree::deleteLeaf);
+        else
+            guard.retire(child, &MerkleTree::deleteNode);
+    }
+    guard.retire(node, &MerkleTree::deleteNode);
+    return true;
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::rehashPath(std::vector<HashNode*>& path, const key_type& key,
+                                                                   Guard& guard, bool defer, HashNode* current) {
+    // A deferred path is only marked, bottom up, so a flush that clears a node top down always finds the child below
+    // it already marked. Nodes that are already dirty are not written to spare the shared cache lines. Either way
+    // the path ends at the shard root, the permanent levels above are only marked.
+    if(defer) {
+        for (std::size_t i = path.size(); i-- > this->shardLevels;) {
             /**
-             * There are two cases when reaching a DATA node,
-             * 1) We are updating an existing value
-             * 2) An intermediary node is needed between the current insert and the node stored in next.
+             * A split that moved the node below into a new node after it was marked either sees the mark and marks
+             * the new node itself (see update) or happened before this check, then the new path is marked from the
+             * bottom. A frozen node leaves the tree, whoever collapses it marks the path above.
              */
-            
-            // check if the data node is what we are inserting
-            // TODO: this is not entirely comprehensive as the hashes could be equal in the case of a remove operation. BUT string compare is slow, so will have to check equality without an expensive operation. Perhaps key == key, then if that is true compare the full hashes. if key == key we have a hash collision though which will cause problems.
-            if(*next->val == *val) {
-                // TODO: this is where we will end up performing the removal operation as well. ATM just insert works.
-                return;
-            } else {
-                /**
-                 * Next is currently at a differing DATA node along the path the inserted node
-                 * needs to be apended. An intermediary hash node needs to be created and placed
-                 * between walker and next.
-                 */
-                
-                // Check if we have an already allocated node
-                if(hashNode == nullptr) {
-                    // Create a new node and descriptor
-                    hashNode = new MerkleNode();
-                    hashDesc = new Descriptor(walker, hashNode, next, dir, next->key >> 1);
-                }
-                else {
-                    // Clean the allocated node and reinitialize the descriptor
-                    hashNode->resetChildNodes();
-                    hashDesc->setHashDescriptor(walker, hashNode, next, dir, next->key >> 1);
-                }
-                
-                // Check which direction next should be apended to the intermediary node
-                switch(next->key % 2) {
-                    case LEFT :
-                        hashNode->left.store(next);
-                        break;
-                    case RIGHT :
-                        hashNode->right.store(next);
-                        break;
-                }
-                
-                // Try to swap the new descriptor
-                if(walker->desc.compare_exchange_weak(currentDesc, hashDesc)) {
-                    // finish the operation
-                    finishOp(hashDesc);
-                    
-                    // Get ready for the next loop iteration
-                    key >>= 1;
-                    walker = hashNode;
-                    
-                    // now that the old descriptor has been swapped, de-allocate it
-                    delete currentDesc;
-                    
-                    // Mark local nodes as used
-                    hashNode = nullptr;
-                    hashDesc = nullptr;
+            if(i + 1 < path.size() && path[i]->children[routeDigit(key, path[i]->level)].load() != path[i + 1]) {
+                Descriptor* desc = guard.protect(path[i + 1]->desc, DESC_SLOT);
+                if(desc == nullptr || desc->typeOp != FREEZE) {
+                    findPath(path, key, guard);
+                    i = path.size();
+                    continue;
                 }
             }
+            if(!path[i]->dirty.load())
+                path[i]->dirty.store(true);
+        }
+        markTop(path);
+        return;
+    }
+    
+    /**
+     * This section performs the hashing operations on the visited nodes simulating a recursive call stack. The bottom
+     * node is always rehashed unless it is current, above it a thread stops as soon as another one's write of the next node has folded in
+     * what this thread wrote below, that thread continues upward in its place. A node moved down by a split is
+     * rehashed along its new path, from the bottom again.
+     */
+    std::size_t bottom = path.size() - 1;
+    if(path[bottom] == current)
+        bottom--;
+    std::uint64_t version = rehash(path[bottom], topOf(path, bottom), guard);
+    for (std::size_t i = bottom; version != 0 && i-- > this->shardLevels;) {
+        version = rehash(path[i], topOf(path, i), guard, path[i + 1], version);
+        if(version == MOVED) {
+            findPath(path, key, guard);
+            version = rehash(path.back(), topOf(path, path.size() - 1), guard);
+            i = path.size() - 1;
+        }
+    }
+    // whoever writes the shard root marks the levels above
+    if(version != 0)
+        markTop(path);
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+bool MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::extendPath(std::vector<HashNode*>& path, unsigned int depth,
+                                                                   const key_type& key, HashNode* target,
+                                                                   Guard& guard) {
+    while(true) {
+        HashNode* node = path.back();
+        Descriptor* desc = guard.protect(node->desc, DESC_SLOT);
+        if(desc != nullptr && desc->typeOp == FREEZE) {
+            finishOp(desc, guard);
+            return false;
+        }
+        MerkleNode* child = guard.protect(node->children[routeDigit(key, node->level)], pathSlot(depth + path.size()));
+        if(node->desc.load() != desc)
+            continue;
+        if(target != nullptr && child == target) {
+            path.push_back(target);
+            return true;
+        }
+        if(child == nullptr || child->type != HASH || !onRoute(key, interior(child), node->level))
+            return target == nullptr;
+        if(target != nullptr && interior(child)->level >= target->level)
+            return false;
+        path.push_back(interior(child));
+    }
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+std::uint64_t MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::rehash(HashNode* node, unsigned int top, Guard& guard,
+                                                                        HashNode* changed, std::uint64_t changedVersion) {
+    unsigned int spins = 0;
+    while(true) {
+        // grab the current version of the hash, used to detect state changes
+        std::uint64_t version = node->hash.version();
+        // a frozen node is on its way out, its digest no longer matters and its children may be retired
+        Descriptor* desc = guard.protect(node->desc, DESC_SLOT);
+        if(desc != nullptr && desc->typeOp == FREEZE)
+            return 0;
+        MerkleNode* children[Radix];
+        for (unsigned int i = 0; i < Radix; i++)
+            children[i] = guard.protect(node->children[i], CHILD_SLOT + i);
+        if(node->desc.load() != desc)
+            continue;
+        // checked again after every lost compare and swap, the winner has often covered the change already
+        if(changed != nullptr && changed->folded.load() >= changedVersion)
+            return 0;
+        // A changed child that has been frozen is never folded in again, its collapse rehashes from here up. One that
+        // a split moved down is still in the tree, below the new node.
+        if(changed != nullptr && std::find(children, children + Radix, changed) == children + Radix) {
+            Descriptor* changedDesc = guard.protect(changed->desc, DESC_SLOT);
+            return changedDesc != nullptr && changedDesc->typeOp == FREEZE ? 0 : MOVED;
+        }
+        /**
+         * Claim the rehash of this version. When another thread holds the claim, its write usually folds in our child
+         * (and the check above ends this call) or at least moves the version on, and the next round is claimed by one
+         * of the waiters. Waiting is bounded so a stalled claimant only costs a duplicate hash, never progress.
+         */
+        if(changed != nullptr) {
+            std::uint64_t claim = node->claim.load();
+            if(claim == version + 1 && spins < CLAIM_SPINS) {
+                spins++;
+                std::this_thread::yield();
+                continue;
+            }
+            if(claim < version + 1)
+                node->claim.compare_exchange_strong(claim, version + 1);
+        }
+        // compute the new hash from the child nodes
+        std::uint64_t versions[Radix];
+        digest_type newVal = hashChildren(node->level, children, versions);
+        // Attempt to compare and swap the newly computed hash, if it fails another thread has
+        // updated the hash. Need to reload the values and recompute the hashes for the next iteration.
+        if(node->hash.compareExchange(version, newVal, lift(newVal, top, node->level), top)) {
+            fold(children, versions);
+            return version + 2;
+        }
+    }
+}
+
+/**
+ * Clears the dirty flags top down and rehashes bottom up. Where both children of a node are dirty and workers are
+ * left, the left subtree is handed to a new thread, so the workers split the dirty region between them. A worker
+ * left on its own goes a level at a time where it can, see flushLevels. With shards the permanent levels that changed
+ * are then combined again up to the root.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::flush(unsigned int threads) {
+    std::lock_guard<std::mutex> lock(this->flushLock);
+    Guard guard(this->reclaimer);
+    HashNode* root = guard.protect(this->root, pathSlot(0));
+    flushTop(root, 0, guard, threads);
+    if(this->shardLevels > 0)
+        summarize(root, 0, guard);
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+typename MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::HashNode*
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::buildTop(unsigned int depth) {
+    HashNode* node = new HashNode(depth, prefix_type());
+    if(depth < this->shardLevels) {
+        for (std::atomic<MerkleNode*>& child : node->children)
+            child.store(buildTop(depth + 1));
+        // nothing summarized yet
+        node->dirty.store(true);
+    } else {
+        this->shards.push_back(node);
+    }
+    return node;
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::flushTop(HashNode* node, unsigned int depth, Guard& guard,
+                                                                 unsigned int threads) {
+    if(depth == this->shardLevels) {
+        if(node->dirty.load() && node->dirty.exchange(false))
+            flushSubtree(node, node->level, depth, guard, threads);
+        return;
+    }
+    // only dirty permanent nodes lead to dirty shards, they are left dirty for summarize
+    std::vector<HashNode*> dirty;
+    for (std::atomic<MerkleNode*>& child : node->children) {
+        if(interior(child.load())->dirty.load())
+            dirty.push_back(interior(child.load()));
+    }
+    forkJoin((unsigned int) dirty.size(), threads,
+             [this, depth, &guard, &dirty](unsigned int j, unsigned int workers, bool spawned) {
+        if(spawned) {
+            Guard workerGuard(this->reclaimer);
+            flushTop(dirty[j], depth + 1, workerGuard, workers);
         } else {
-            // Still have HASH nodes to traverse, shift the key, set walker to next.
-            key >>= 1;
-            walker = next;
+            flushTop(dirty[j], depth + 1, guard, workers);
         }
-    } // end while
+    });
+}
+
+/**
+ * Without shards a HASH node below the root only exists where two or more values share a path, a single value sits
+ * in the highest slot it has to itself. A permanent node that holds nothing or a single value is passed up as such,
+ * so the root comes out as it would in the tree without permanent levels. A shard root that is a HASH node there is
+ * combined from the children read with it, its own digest may not have caught up with them yet.
+ * The summary of a permanent node above the shard roots is cached in the node and only combined again while the node
+ * is dirty. Whoever writes a shard root marks the nodes above it after the write (see markTop), bottom up, so a
+ * summary combined after its flag was cleared includes it. A node stays dirty if the cache lost a race with another
+ * summary or a child is still dirty, a shard root with lazy updates that are not flushed yet.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+typename MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::Summary
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::summarize(HashNode* node, unsigned int depth, Guard& guard,
+                                                             bool fresh) {
+    bool cached = depth < this->shardLevels && !fresh;
+    std::uint64_t version = 0;
+    if(cached) {
+        version = node->hash.version();
+        if(!node->dirty.load() || !node->dirty.exchange(false)) {
+            digest_type unused;
+            std::uint64_t type;
+            digest_type digest = node->hash.load(version, unused, type);
+            return {digest, (NodeType) type};
+        }
+    }
     
-    // If we have unused intermediary nodes, free them from memory
-    if(hashNode != nullptr) {
-        delete hashNode;
-        delete hashDesc;
-    }
-
-    // This section performs the hashing operations on the visited nodes simulating a recursive call stack.
-    while(!visited.empty()) {
-        // Grab the top node from the stack
-        walker = visited.top();
-        MerkleNode* left;
-        MerkleNode* right;
-        visited.pop();
-        std::string* oldHash;
-        std::string* newVal = new std::string();
+    Summary children[Radix];
+    if(depth < this->shardLevels) {
+        for (unsigned int i = 0; i < Radix; i++)
+            children[i] = summarize(interior(node->children[i].load()), depth + 1, guard, fresh);
+    } else {
+        MerkleNode* nodes[Radix];
+        Descriptor* desc;
         do {
-            // TODO: there may be a more efficient way to do this string arithmetic
-            *newVal = "";
-            // grab a temporary copy of the hash, used to detect state changes
-            oldHash = walker->hash.load();
-            left = walker->left.load();
-            right = walker->right.load();
-            
-            // obtain the hashes from the child nodes
-            if(left != nullptr)
-                *newVal += *(left->hash.load());
+            desc = guard.protect(node->desc, DESC_SLOT);
+            for (unsigned int i = 0; i < Radix; i++)
+                nodes[i] = guard.protect(node->children[i], CHILD_SLOT + i);
+        } while(node->desc.load() != desc);
+        for (unsigned int i = 0; i < Radix; i++) {
+            std::uint64_t version;
+            if(nodes[i] == nullptr || nodes[i]->type == EMPTY)
+                children[i] = {digest_type(), EMPTY};
+            else
+                children[i] = {childDigest(nodes[i], depth, version), nodes[i]->type};
+        }
+    }
     
-            if(right != nullptr)
-                *newVal += *(right->hash.load());
-            
-            // compute the new hashes
-            *newVal = hashFunc(*newVal);
-            // Attempt to compare and swap the newly computed hash, if it fails another thread has
-            // updated the hash. Need to reload the values and recompute the hashes for the next iteration.
-        } while(!walker->hash.compare_exchange_weak(oldHash, newVal));
-        
-        // TODO: this is a memory leak, but need to think about how to solve it. The issue is oldhash could be referenced by other threads as they work.
-        // TODO: Thought 1 : maybe collect discareded old strings to remove later on qqueue?
-        //delete oldHash;
+    digest_type digests[Radix];
+    unsigned int count = 0;
+    const Summary* only = nullptr;
+    for (const Summary& child : children) {
+        if(child.type != EMPTY) {
+            digests[count++] = child.hash;
+            only = &child;
+        }
     }
+    Summary summary;
+    if(depth > 0 && count == 0)
+        summary = {digest_type(), EMPTY};
+    else if(depth > 0 && count == 1 && only->type == DATA)
+        summary = *only;
+    else
+        summary = {combine(digests, count), HASH};
+    
+    if(cached) {
+        bool pending = false;
+        for (std::atomic<MerkleNode*>& child : node->children)
+            pending = pending || interior(child.load())->dirty.load();
+        if(!node->hash.compareExchange(version, summary.hash, summary.hash, summary.type) || pending)
+            node->dirty.store(true);
+    }
+    return summary;
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::flushSubtree(HashNode* node, unsigned int top, unsigned int depth,
+                                                                     Guard& guard, unsigned int threads) {
+    if constexpr (HASH_MANY && GUARD_PROTECTS_ALL) {
+        if(threads <= 1 && batching()) {
+            flushLevels({{node, nullptr, 0, top}}, depth, guard);
+            return;
+        }
+    }
+    MerkleNode* children[Radix];
+    Descriptor* desc;
+    do {
+        desc = guard.protect(node->desc, DESC_SLOT);
+        // a frozen node leaves the tree, whoever collapses it marks the path above
+        if(desc != nullptr && desc->typeOp == FREEZE)
+            return;
+        for (unsigned int i = 0; i < Radix; i++)
+            children[i] = guard.protect(node->children[i], CHILD_SLOT + i);
+    } while(node->desc.load() != desc);
+    
+    // the dirty flags are only cleared once a child is protected again, see flushChild
+    std::vector<unsigned int> dirty;
+    for (unsigned int i = 0; i < Radix; i++) {
+        if(children[i] != nullNode && children[i]->type == HASH && interior(children[i])->dirty.load())
+            dirty.push_back(i);
+    }
+    
+    // node stays protected by this guard until the workers are joined
+    forkJoin((unsigned int) dirty.size(), threads,
+             [this, node, depth, &guard, &dirty, &children](unsigned int j, unsigned int workers, bool spawned) {
+        if(spawned) {
+            Guard workerGuard(this->reclaimer);
+            flushChild(node, dirty[j], interior(children[dirty[j]]), depth, workerGuard, workers);
+        } else {
+            flushChild(node, dirty[j], interior(children[dirty[j]]), depth, guard, workers);
+        }
+    });
+    rehash(node, top, guard);
+}
+
+/**
+ * The children of node only stay in CHILD_SLOT until the first of them is flushed, so each is protected again from its
+ * slot. A HASH child is only replaced once it is frozen, whoever collapses it marks the path above, or when a split
+ * moves it down, which marks the new node if the child is still dirty. Either way there is nothing left to flush here.
+ * A child that is moved after its flag was cleared here misses from the new node what was flushed below it, the nodes
+ * the split put in between are rehashed after it.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::flushChild(HashNode* node, unsigned int i, HashNode* child,
+                                                                   unsigned int depth, Guard& guard,
+                                                                   unsigned int threads) {
+    if(guard.protect(node->children[i], pathSlot(depth + 1)) != child)
+        return;
+    Descriptor* desc = guard.protect(node->desc, DESC_SLOT);
+    if(desc != nullptr && desc->typeOp == FREEZE)
+        return;
+    if(!child->dirty.exchange(false))
+        return;
+    flushSubtree(child, node->level + 1, depth + 1, guard, threads);
+    rehashMoved(node, i, child, depth, guard);
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::rehashMoved(HashNode* node, unsigned int i, HashNode* child,
+                                                                    unsigned int depth, Guard& guard) {
+    if(node->children[i].load() == child)
+        return;
+    // the way down to child takes over its slot
+    guard.set(pathSlot(depth + 1) + 1, child);
+    std::vector<HashNode*> route = {node};
+    if(extendPath(route, depth, key_type(child->prefix), child, guard)) {
+        for (std::size_t j = route.size() - 1; j-- > 1;)
+            rehash(route[j], route[j - 1]->level + 1, guard);
+    }
+}
+
+/**
+ * Takes the same steps as flushSubtree and flushChild, but a level only goes down once the flags of the whole level
+ * above are cleared, and only goes up once the whole level below is rehashed, so the children read for a level still
+ * come out as they would one node at a time. A level wider than FLUSH_WIDTH is flushed in pieces, one after the
+ * other, which keeps what a level is hashed from in cache. A node frozen on the way down is skipped with what is
+ * below it.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::flushLevels(std::vector<Flushed> nodes, unsigned int depth,
+                                                                    Guard& guard) {
+    // levels[k] holds the nodes k levels of the path below nodes
+    std::vector<std::vector<Flushed>> levels;
+    levels.push_back(std::move(nodes));
+    while(true) {
+        std::vector<Flushed> below;
+        for (const Flushed& above : levels.back()) {
+            MerkleNode* children[Radix];
+            Descriptor* desc;
+            do {
+                desc = guard.protect(above.node->desc, DESC_SLOT);
+                for (unsigned int i = 0; i < Radix; i++)
+                    children[i] = guard.protect(above.node->children[i], CHILD_SLOT + i);
+            } while(above.node->desc.load() != desc);
+            if(desc != nullptr && desc->typeOp == FREEZE)
+                continue;
+            for (unsigned int i = 0; i < Radix; i++) {
+                if(children[i] == nullNode || children[i]->type != HASH)
+                    continue;
+                HashNode* child = interior(children[i]);
+                if(child->dirty.load() && child->dirty.exchange(false))
+                    below.push_back({child, above.node, i, above.node->level + 1});
+            }
+        }
+        if(below.size() <= FLUSH_WIDTH) {
+            if(below.empty())
+                break;
+            levels.push_back(std::move(below));
+            continue;
+        }
+        unsigned int next = depth + (unsigned int) levels.size();
+        for (std::size_t first = 0; first < below.size(); first += FLUSH_WIDTH) {
+            std::size_t last = std::min(below.size(), first + FLUSH_WIDTH);
+            flushLevels(std::vector<Flushed>(below.begin() + first, below.begin() + last), next, guard);
+        }
+        break;
+    }
+    
+    for (std::size_t k = levels.size(); k-- > 0;) {
+        rehashMany(levels[k], guard);
+        for (const Flushed& flushed : levels[k]) {
+            if(flushed.parent != nullptr)
+                rehashMoved(flushed.parent, flushed.i, flushed.node, depth + (unsigned int) k - 1, guard);
+        }
+    }
+}
+
+// Reads every node like rehash does, a node written to since it was read is rehashed on its own.
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::rehashMany(const std::vector<Flushed>& nodes, Guard& guard) {
+    std::vector<Read> reads(nodes.size());
+    std::vector<std::uint64_t> versions(nodes.size());
+    for (std::size_t j = 0; j < nodes.size(); j++) {
+        HashNode* node = nodes[j].node;
+        Read& read = reads[j];
+        read.node = node;
+        read.top = nodes[j].top;
+        Descriptor* desc;
+        do {
+            versions[j] = node->hash.version();
+            desc = guard.protect(node->desc, DESC_SLOT);
+            for (unsigned int i = 0; i < Radix; i++)
+                read.children[i] = guard.protect(node->children[i], CHILD_SLOT + i);
+        } while(node->desc.load() != desc);
+        read.frozen = desc != nullptr && desc->typeOp == FREEZE;
+    }
+    
+    hashChildrenMany(reads);
+    for (std::size_t j = 0; j < nodes.size(); j++) {
+        const Read& read = reads[j];
+        if(read.frozen)
+            continue;
+        if(read.node->hash.compareExchange(versions[j], read.digest, read.lifted, read.top))
+            fold(read.children, read.versions);
+        else
+            rehash(read.node, read.top, guard);
+    }
+}
+
+/**
+ * Groups the nodes by input length (the number of present children, group count - 1) like validate. The lifts take a
+ * hash for every level skipped (see childDigest), those are done in rounds, one level further for every node left in
+ * each round.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::hashChildrenMany(std::vector<Read>& reads) const {
+    const std::size_t N = digest_type::SIZE;
+    std::vector<std::size_t> groups[Radix];
+    std::vector<unsigned char> inputs[Radix];
+    for (std::size_t j = 0; j < reads.size(); j++) {
+        Read& read = reads[j];
+        // an empty node hashes to all zeros, EMPTY nodes count as missing
+        read.digest = digest_type();
+        if(read.frozen)
+            continue;
+        digest_type digests[Radix];
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < Radix; i++) {
+            read.versions[i] = 0;
+            if(read.children[i] != nullptr && read.children[i]->type != EMPTY)
+                digests[count++] = childDigest(read.children[i], read.node->level, read.versions[i]);
+        }
+        if(count == 0)
+            continue;
+        groups[count - 1].push_back(j);
+        for (unsigned int c = 0; c < count; c++)
+            inputs[count - 1].insert(inputs[count - 1].end(), digests[c].bytes, digests[c].bytes + N);
+    }
+    
+    std::vector<const unsigned char*> messages;
+    std::vector<digest_type> digests;
+    for (std::size_t group = 0; group < Radix; group++) {
+        std::size_t len = (group + 1) * N;
+        if(groups[group].empty())
+            continue;
+        messages.resize(groups[group].size());
+        digests.resize(groups[group].size());
+        for (std::size_t g = 0; g < messages.size(); g++)
+            messages[g] = inputs[group].data() + g * len;
+        this->hashPolicy.hashMany(messages.data(), (unsigned int) len, (unsigned int) messages.size(), digests.data());
+        for (std::size_t g = 0; g < messages.size(); g++)
+            reads[groups[group][g]].digest = digests[g];
+    }
+    
+    std::vector<std::size_t> lifting;
+    for (std::size_t j = 0; j < reads.size(); j++) {
+        reads[j].lifted = reads[j].digest;
+        if(!reads[j].frozen && reads[j].top < reads[j].node->level)
+            lifting.push_back(j);
+    }
+    for (unsigned int round = 1; !lifting.empty(); round++) {
+        messages.resize(lifting.size());
+        digests.resize(lifting.size());
+        for (std::size_t g = 0; g < lifting.size(); g++)
+            messages[g] = reads[lifting[g]].lifted.bytes;
+        this->hashPolicy.hashMany(messages.data(), (unsigned int) N, (unsigned int) messages.size(), digests.data());
+        std::size_t left = 0;
+        for (std::size_t g = 0; g < lifting.size(); g++) {
+            Read& read = reads[lifting[g]];
+            read.lifted = digests[g];
+            if(read.top + round < read.node->level)
+                lifting[left++] = lifting[g];
+        }
+        lifting.resize(left);
+    }
+}
+
+// Hashes the binary digests of the present children of an interior node in order, an empty node hashes to all zeros.
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+typename MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::digest_type
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::hashChildren(unsigned int level, MerkleNode* const* children,
+                                                                std::uint64_t* versions) {
+    std::uint64_t unused[Radix];
+    if(versions == nullptr)
+        versions = unused;
+    
+    // EMPTY nodes count as missing
+    digest_type digests[Radix];
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < Radix; i++) {
+        versions[i] = 0;
+        if(children[i] != nullptr && children[i]->type != EMPTY)
+            digests[count++] = childDigest(children[i], level, versions[i]);
+    }
+    return combine(digests, count);
 }
 
 
 // Allows threads to help complete a pending operation
-template<typename T>
-void MerkleTree<T>::finishOp(Descriptor* job) {
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::finishOp(Descriptor* job, Guard& guard) {
     if(job != nullptr) {
+        // A frozen node has nothing left to finish itself, its collapse happens on the parent.
+        if(job->typeOp == FREEZE) {
+            helpCollapse(job, guard);
+            return;
+        }
+        
         std::atomic<MerkleNode*>* update_node;
         // only try to finish the operation if pending
         if(job->pending) {
-            // This switch grabs the address atomic variable that will be updated.
-            switch(job->dir) {
-                case LEFT :
-                    update_node = &(job->parent->left);
-                    break;
-                case RIGHT :
-                    update_node = &(job->parent->right);
-                    break;
-            }
+            // the address of the atomic variable that will be updated
+            update_node = &(job->parent->children[job->dir]);
             
-            switch(job->typeOp) {
-                // For HASH operations, we are adding an intermediary HASH node between an existing HASH Node
-                // and a DATA node. (The insert operation must be along the same key path) This operation 
-                // requires two "atomic" operations. First we need to swap in the new intermediary node, then
-                // we need to modify the old DATA node's key value.
-                case HASH :
-                    update_node->compare_exchange_weak(job->oldChild, job->child);
-                    if(job->oldChild->key != job->key)
-                        job->oldChild->key = job->key;
-                    break;
-                // For DATA node Operations we simply have to compare and swap in the new DATA node into the parent.
-                case DATA :
-                    update_node->compare_exchange_weak(nullNode, job->child);
-                    break;
-            }
+            /**
+             * Every operation swaps the child it expects for a new one, which only succeeds for the first helper.
+             * INSERT_HASH adds an intermediary HASH node between an existing HASH Node and a DATA (or compressed
+             * HASH) node, REMOVE and COLLAPSE are described with OpType.
+             * The expected value is copied, a failed compare_exchange writes the current value back into it and the
+             * descriptor is shared with every other helper. A weak CAS could fail spuriously and the job would then be
+             * marked done without having happened.
+             * A slot never holds the same node twice, but a node freed after leaving the slot could come back at the
+             * same address. Once the hazard is published, the expected node can only have been retired if the job is
+             * no longer pending.
+             */
+            guard.set(EXPECTED_SLOT, job->oldChild);
+            if(!job->pending)
+                return;
+            MerkleNode* expected = job->oldChild;
+            update_node->compare_exchange_strong(expected, job->child);
+            // the collapse is done before the parent can be frozen or retired itself, see helpCollapse
+            if(job->typeOp == COLLAPSE)
+                interior(job->oldChild)->desc.load()->pending = false;
             // Mark the job as completed.
             job->pending = false;
         }
     }
 }
 
-template<typename T>
-bool MerkleTree<T>::contains(std::string hash, std::size_t key) {
-    bool result = false;
-    MerkleNode* walker = this->root.load();
-    while (walker != nullptr) {
+/**
+ * Installs a COLLAPSE descriptor on the parent of the frozen node unless one already did its work. Every thread that
+ * finds the FREEZE descriptor helps, the replacement node is shared through it so they all install the same one.
+ * A split can move the frozen node below a new node, which is then its parent, so the parent is looked for on the
+ * route of the frozen node from the one it was frozen under. None of the nodes on that route can be frozen
+ * themselves while the frozen HASH node is below them, and they are only retired after freeze->pending has been
+ * cleared, so publishing the first one and checking pending is enough to keep it alive.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::helpCollapse(Descriptor* freeze, Guard& guard) {
+    HashNode* parent = freeze->parent;
+    HashNode* frozen = interior(freeze->oldChild);
+    guard.set(PARENT_SLOT, parent);
+    if(!freeze->pending)
+        return;
+    MerkleNode* replacement = this->seal(freeze, guard);
+    
+    // the parent and the node below it on the way down take turns in the two slots
+    unsigned int slot = SEARCH_SLOT;
+    while(true) {
+        Descriptor* parentDesc = guard.protect(parent->desc, PARENT_DESC_SLOT);
+        finishOp(parentDesc, guard);
+        unsigned int dir = routeDigit(key_type(frozen->prefix), parent->level);
+        MerkleNode* child = guard.protect(parent->children[dir], slot);
+        if(parent->desc.load() != parentDesc)
+            continue;
         
-        // Arrived at a leaf node.
-        if (walker->type == DATA) {
-            // check if the leaf contains the correct value
-            if (walker->hash.load()->compare(hash) == 0)
-                result = true;
-            // break from the loop, if the hash was not equal the value is not in the tree as we are at the bottom
+        if(child == frozen) {
+            Descriptor* collapseDesc = new Descriptor(COLLAPSE, parent, replacement, frozen, dir);
+            guard.set(COLLAPSE_SLOT, collapseDesc);
+            if(parent->desc.compare_exchange_strong(parentDesc, collapseDesc)) {
+                finishOp(collapseDesc, guard);
+                guard.retire(parentDesc);
+                break;
+            }
+            delete collapseDesc;
+        } else if(child != nullptr && child->type == HASH && interior(child)->level < frozen->level) {
+            parent = interior(child);
+            slot = slot == SEARCH_SLOT ? PARENT_SLOT : SEARCH_SLOT;
+        } else {
+            // already collapsed
             break;
         }
+    }
+    freeze->pending = false;
+}
+
+/**
+ * Inserts fill empty slots without a descriptor, so freezing a node does not stop them. Every slot that is empty once
+ * the node is frozen is sealed instead, and only then is the replacement made from the values left: nothing (EMPTY),
+ * a copy of the last value, or a copy of the node if inserts filled slots before they were sealed. Every helper
+ * makes one, the first published in freeze->child is the one that goes in. The children of the frozen node are
+ * retired once it is published, until then the one looked at is kept in SEAL_SLOT.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+typename MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::MerkleNode*
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::seal(Descriptor* freeze, Guard& guard) {
+    HashNode* frozen = interior(freeze->oldChild);
+    // the values left, then their copies
+    MerkleNode* children[Radix] = {};
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < Radix; i++) {
+        MerkleNode* child = guard.protect(frozen->children[i], SEAL_SLOT);
+        while(true) {
+            // the children stay in their slots when they are retired, only an unpublished replacement keeps them
+            if(freeze->child.load() != nullptr)
+                return freeze->child.load();
+            if(child == sealed() || (child != nullptr && child->type != EMPTY))
+                break;
+            MerkleNode* empty = child;
+            if(frozen->children[i].compare_exchange_strong(child, sealed())) {
+                guard.retire(empty, &MerkleTree::deleteNode);
+                child = sealed();
+                break;
+            }
+            child = guard.protect(frozen->children[i], SEAL_SLOT);
+        }
+        if(child != sealed() && i != freeze->dir) {
+            children[i] = child;
+            count++;
+        }
+    }
+    
+    auto discard = [&children](unsigned int copied) {
+        for (unsigned int i = 0; i < copied; i++) {
+            if(children[i] != nullptr)
+                deleteNode(children[i]);
+        }
+    };
+    MerkleNode* replacement = nullptr;
+    for (unsigned int i = 0; i < Radix; i++) {
+        if(children[i] == nullptr)
+            continue;
+        MerkleNode* child = guard.protect(frozen->children[i], SEAL_SLOT);
+        if(freeze->child.load() != nullptr) {
+            discard(i);
+            return freeze->child.load();
+        }
+        children[i] = replacement = new LeafNode(leaf(child)->hash, leaf(child)->val);
+    }
+    if(count == 0) {
+        replacement = new MerkleNode(EMPTY);
+    } else if(count > 1) {
+        HashNode* copy = new HashNode(frozen->level, frozen->prefix);
+        for (unsigned int i = 0; i < Radix; i++)
+            copy->children[i].store(children[i]);
+        // the copy goes where the frozen node is, lifted for the parent the frozen node was last written for
+        std::uint64_t version, top;
+        digest_type lifted;
+        frozen->hash.load(version, lifted, top);
+        initDigest(copy, hashChildren(copy->level, children), (unsigned int) top);
+        replacement = copy;
+    }
+    
+    MerkleNode* published = nullptr;
+    if(freeze->child.compare_exchange_strong(published, replacement))
+        return replacement;
+    discard(Radix);
+    if(count != 1)
+        deleteNode(replacement);
+    return published;
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+bool MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::contains(const digest_type& hash, key_type key) {
+    Guard guard(this->reclaimer);
+    unsigned int depth = 0;
+    HashNode* walker = guard.protect(this->root, pathSlot(0));
+    while (true) {
+        // The children of a frozen node may already be retired, help it out of the tree and start over.
+        Descriptor* desc = guard.protect(walker->desc, DESC_SLOT);
+        if (desc != nullptr && desc->typeOp == FREEZE) {
+            finishOp(desc, guard);
+            walker = guard.protect(this->root, pathSlot(0));
+            depth = 0;
+            continue;
+        }
         
         // If there are further parent nodes determine which direction to continue the search and set the walker to the next node to search.
-        switch (key % 2) {
-            case LEFT :
-                walker = walker->left.load();
-                break;
-            case RIGHT :
-                walker = walker->right.load();
+        MerkleNode* next = guard.protect(walker->children[routeDigit(key, walker->level)], pathSlot(depth + 1));
+        if (walker->desc.load() != desc)
+            continue;
+        if (next == nullptr || next->type == EMPTY)
+            return false;
+        // Arrived at a leaf node. If the hash is not equal the value is not in the tree as we are at the bottom.
+        if (next->type == DATA)
+            return leaf(next)->hash == hash;
+        // a compressed node whose skipped digits differ from ours holds none of our values
+        if (!onRoute(key, interior(next), walker->level))
+            return false;
+        walker = interior(next);
+        depth++;
+    }
+}
+
+/**
+ * Every lookup of a group moves one level per round. A step reads only the node the lookup reached in the previous
+ * round, whose first line has been prefetched since, and the node it moves to is only prefetched, its type and prefix
+ * are looked at in the next round. A lookup that meets a frozen node starts over from the root like contains does.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+void MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::contains_many(std::span<const T> values, std::vector<bool>& found) {
+    found.assign(values.size(), false);
+    
+    struct Lookup {
+        digest_type hash;
+        key_type key;
+        std::size_t index;
+        MerkleNode* node;
+        // the level of the node the lookup came from, node is compressed if it routes further down
+        unsigned int parentLevel;
+        // the slots of the lookup, node sits in slot + turn
+        unsigned int slot;
+        unsigned int turn;
+    };
+    Lookup group[LOOKUP_GROUP];
+    
+    for (std::size_t first = 0; first < values.size(); first += LOOKUP_GROUP) {
+        // a guard per group, an epoch is not held up by the whole batch
+        Guard guard(this->reclaimer);
+        unsigned int active = (unsigned int) std::min<std::size_t>(LOOKUP_GROUP, values.size() - first);
+        for (unsigned int j = 0; j < active; j++) {
+            Lookup& lookup = group[j];
+            lookup.index = first + j;
+            lookup.hash = leafHash(values[lookup.index]);
+            lookup.key = routeKey(lookup.hash);
+            lookup.slot = lookupSlot(j);
+            lookup.turn = 0;
+            lookup.node = guard.protect(this->root, lookup.slot);
+            lookup.parentLevel = 0;
+        }
+        
+        // lookups that are done are swapped out behind the active ones, their slots go with them
+        while (active > 0) {
+            for (unsigned int j = 0; j < active;) {
+                Lookup& lookup = group[j];
+                MerkleNode* node = lookup.node;
+                bool done = false;
+                if (node == nullptr || node->type == EMPTY) {
+                    done = true;
+                } else if (node->type == DATA) {
+                    found[lookup.index] = leaf(node)->hash == lookup.hash;
+                    done = true;
+                } else if (node != this->root.load() && !onRoute(lookup.key, interior(node), lookup.parentLevel)) {
+                    // a compressed node whose skipped digits differ from ours holds none of our values
+                    done = true;
+                } else {
+                    HashNode* walker = interior(node);
+                    Descriptor* desc = guard.protect(walker->desc, DESC_SLOT);
+                    if (desc != nullptr && desc->typeOp == FREEZE) {
+                        finishOp(desc, guard);
+                        lookup.turn = 0;
+                        lookup.node = guard.protect(this->root, lookup.slot);
+                        lookup.parentLevel = 0;
+                        j++;
+                        continue;
+                    }
+                    // next goes into the slot walker does not sit in
+                    unsigned int turn = lookup.turn ^ 1;
+                    MerkleNode* next = guard.protect(walker->children[routeDigit(lookup.key, walker->level)],
+                                                     lookup.slot + turn);
+                    if (walker->desc.load() != desc)
+                        continue;
+                    __builtin_prefetch(next);
+                    lookup.node = next;
+                    lookup.parentLevel = walker->level;
+                    lookup.turn = turn;
+                }
+                
+                if (done) {
+                    active--;
+                    if (j != active) {
+                        // the guard slots stay with the lookup, only its place in the group changes
+                        std::swap(group[j], group[active]);
+                    }
+                } else {
+                    j++;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * The walk keeps the siblings of every node on the route top down and orders them bottom up once it reaches the leaf.
+ * The siblings on the permanent levels above the shard roots are the summaries cached in them (see summarize), and a
+ * permanent node below the root with nothing but the value below it has no level of its own in the tree without
+ * shards (see summarize). A compressed child adds a level without siblings for every level it skipped.
+ */
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+std::optional<typename MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::Proof>
+MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::prove(const digest_type& hash, key_type key,
+                                                         unsigned int attempts) {
+    // a node on the route, its siblings are found[first, first + count)
+    struct Step {
+        std::size_t first;
+        unsigned int count;
+        unsigned int position;
+        // levels skipped between the node and the next one on the route
+        unsigned int skipped;
+        // a permanent node below the root
+        bool permanent;
+    };
+    std::vector<Step> steps;
+    std::vector<digest_type> found;
+    // the nodes of the route, path[d] at depth d
+    std::vector<HashNode*> path;
+    Proof proof;
+    proof.leaf = hash;
+    
+    for (unsigned int attempt = 0; attempt < attempts; attempt++) {
+        Guard guard(this->reclaimer);
+        steps.clear();
+        found.clear();
+        path.clear();
+        HashNode* walker = guard.protect(this->root, pathSlot(0));
+        unsigned int depth = 0;
+        // what the shard root of the route (the root without shards) stored when the walk passed it
+        digest_type stored;
+        while (true) {
+            unsigned int dir = routeDigit(key, walker->level);
+            Step step = {found.size(), 0, 0, 0, depth > 0 && depth <= this->shardLevels};
+            MerkleNode* next;
+            if(depth < this->shardLevels) {
+                // permanent nodes are never replaced, nothing to protect
+                for (unsigned int i = 0; i < Radix; i++) {
+                    if(i == dir) {
+                        step.position = step.count;
+                        continue;
+                    }
+                    Summary sibling = summarize(interior(walker->children[i].load()), depth + 1, guard);
+                    if(sibling.type != EMPTY) {
+                        found.push_back(sibling.hash);
+                        step.count++;
+                    }
+                }
+                next = walker->children[dir].load();
+            } else {
+                // The children of a frozen node may already be retired, help it out of the tree and start over.
+                Descriptor* desc = guard.protect(walker->desc, DESC_SLOT);
+                if(desc != nullptr && desc->typeOp == FREEZE) {
+                    finishOp(desc, guard);
+                    walker = guard.protect(this->root, pathSlot(0));
+                    depth = 0;
+                    steps.clear();
+                    found.clear();
+                    path.clear();
+                    continue;
+                }
+                if(depth == this->shardLevels)
+                    stored = walker->hash.load();
+                MerkleNode* children[Radix];
+                for (unsigned int i = 0; i < Radix; i++)
+                    children[i] = guard.protect(walker->children[i], i == dir ? pathSlot(depth + 1) : CHILD_SLOT + i);
+                if(walker->desc.load() != desc)
+                    continue;
+                for (unsigned int i = 0; i < Radix; i++) {
+                    std::uint64_t version;
+                    if(i == dir)
+                        step.position = step.count;
+                    else if(children[i] != nullptr && children[i]->type != EMPTY) {
+                        found.push_back(childDigest(children[i], walker->level, version));
+                        step.count++;
+                    }
+                }
+                next = children[dir];
+            }
+            
+            if(next == nullptr || next->type == EMPTY)
+                return std::nullopt;
+            if(next->type == DATA) {
+                if(!(leaf(next)->hash == hash))
+                    return std::nullopt;
+                steps.push_back(step);
+                path.push_back(walker);
                 break;
+            }
+            // a compressed node whose skipped digits differ from ours holds none of our values
+            if(!onRoute(key, interior(next), walker->level))
+                return std::nullopt;
+            step.skipped = interior(next)->level - walker->level - 1;
+            steps.push_back(step);
+            path.push_back(walker);
+            walker = interior(next);
+            depth++;
+        }
+        
+        /**
+         * The digests below the shard root are checked against the one it stored, a writer that changed one of them
+         * after the walk read the shard root leaves a proof of no shard root at all. The siblings above are the
+         * summaries of the other shards the walk read, so the root is the one a flush reading them would combine,
+         * whatever those shards went through meanwhile.
+         */
+        digest_type digest = hash;
+        for (std::size_t s = steps.size(); s-- > this->shardLevels;) {
+            for (unsigned int k = 0; k < steps[s].skipped; k++)
+                digest = this->hashPolicy.combine(digest);
+            digest = combineLevel(this->hashPolicy, digest, found.data() + steps[s].first, steps[s].count,
+                                  steps[s].position);
+        }
+        if(!(digest == stored)) {
+            /**
+             * A writer stalled halfway up its path, or a lazy update that is not flushed yet, leaves digests the nodes
+             * above do not have yet. Waiting for the writer could take as long as the stall and a flush would rehash
+             * the whole tree, so only the route is rehashed, the next walk then only fails if another write comes in
+             * between. The dirty flags stay, the next flush still finds everything below them.
+             */
+            for (std::size_t d = path.size(); d-- > this->shardLevels;)
+                rehash(path[d], topOf(path, d), guard);
+            markTop(path);
+            continue;
+        }
+        
+        proof.levels.clear();
+        proof.siblings.clear();
+        // whether the value is all there is below the node looked at
+        bool alone = true;
+        for (std::size_t s = steps.size(); s-- > 0;) {
+            const Step& step = steps[s];
+            if(step.permanent && step.count == 0 && alone)
+                continue;
+            proof.levels.insert(proof.levels.end(), step.skipped, {0, 0});
+            proof.levels.push_back({step.count, step.position});
+            proof.siblings.insert(proof.siblings.end(), found.begin() + step.first,
+                                  found.begin() + step.first + step.count);
+            alone = false;
         }
-        // decrement the key and continue.
-        key >>= 1;
+        proof.root = *proofRoot(proof, this->hashPolicy);
+        return proof;
     }
-    return result;
+    return std::nullopt;
 }
 
 // TODO: This will not currently work with concurrent execution. However it does work sequentially for testing at the moment.
-template<typename T>
-bool MerkleTree<T>::validate() {
+template<typename T, typename HashPolicy, KeyMode Mode, typename Reclaimer, unsigned int Radix>
+bool MerkleTree<T, HashPolicy, Mode, Reclaimer, Radix>::validate() {
     bool result = true;
     
-    // create an empty stack and push root node
-    std::stack<MerkleNode*> stk;
-    stk.push(this->root.load());
+    // digests left stale by lazy mode are brought up to date first
+    this->flush(this->flushThreads);
+    
+    // the permanent levels are checked by combining them again, below them every HASH node is checked
+    if(this->shardLevels > 0) {
+        Guard guard(this->reclaimer);
+        if(summarize(this->root.load(), 0, guard, true).hash != this->root.load()->hash.load())
+            result = false;
+    }
+    
+    // create an empty stack and push the shard roots (the root without shards)
+    std::stack<HashNode*> stk;
+    for (HashNode* shard : this->shards)
+        stk.push(shard);
     
     // create another stack to store post-order traversal
-    std::stack<MerkleNode*> order;
+    std::stack<HashNode*> order;
     
     // run till stack is not empty
     while (!stk.empty()) {
         // we pop a node from the stack and push the data to output stack
-        MerkleNode* curr = stk.top();
+        HashNode* curr = stk.top();
         stk.pop();
+        order.push(curr);
         
-        if(curr->val == NULL)
-            order.push(curr);
-        
-        // push left and right child of popped node to the stack
-        if (curr->left.load() != nullNode)
-            stk.push(curr->left.load());
-        
-        if (curr->right.load() != nullNode)
-            stk.push(curr->right.load());
+        // push the HASH children of popped node to the stack
+        for (std::atomic<MerkleNode*>& child : curr->children) {
+            if (child.load() != nullNode && child.load()->type == HASH)
+                stk.push(interior(child.load()));
+        }
     }
     
-    MerkleNode *walker, *left, *right;
-    std::string computed_hash;
+    /**
+     * Every HASH node is checked against its children's stored digests, so the nodes are independent of each other
+     * and can be hashed in batches. Nodes are grouped by input length (the number of present children, group count - 1)
+     * so a policy with a multi-buffer hashMany can process each group in a single call.
+     */
+    const std::size_t N = digest_type::SIZE;
+    std::vector<HashNode*> nodes[Radix];
+    std::vector<unsigned char> inputs[Radix];
+    HashNode* walker;
     
-    //TODO: This could probably be optimized some.
     while (!order.empty()) {
-        computed_hash = "";
         walker = order.top();
-        left = walker->left.load();
-        right = walker->right.load();
+        order.pop();
+        std::vector<MerkleNode*> present;
+        for (std::atomic<MerkleNode*>& child : walker->children) {
+            if(child.load() != nullNode && child.load()->type != EMPTY)
+                present.push_back(child.load());
+        }
         
-        if(left != nullNode)
-            computed_hash += *(left->hash.load());
-        if(right != nullNode)
-            computed_hash += *(right->hash.load());
+        if(present.empty()) {
+            if(walker->hash.load() != digest_type())
+                result = false;
+            continue;
+        }
         
-        computed_hash = hashFunc(computed_hash);
-        if(computed_hash.compare(*walker->hash.load()) != 0)
-            result = false;
+        // a lifted digest is checked against the one it was lifted from, and that one is hashed
+        std::size_t group = present.size() - 1;
+        nodes[group].push_back(walker);
+        for (MerkleNode* child : present) {
+            std::uint64_t version;
+            digest_type childHash = child->type == DATA ? leaf(child)->hash
+                : lift(interior(child)->hash.load(), walker->level + 1, interior(child)->level);
+            if(childDigest(child, walker->level, version) != childHash)
+                result = false;
+            inputs[group].insert(inputs[group].end(), childHash.bytes, childHash.bytes + N);
+        }
+    }
+    
+    for (std::size_t group = 0; group < Radix; group++) {
+        std::size_t len = (group + 1) * N;
+        std::vector<digest_type> computed(nodes[group].size());
+        if constexpr (HASH_MANY) {
+            std::vector<const unsigned char*> messages(nodes[group].size());
+            for (std::size_t i = 0; i < messages.size(); i++)
+                messages[i] = inputs[group].data() + i * len;
+            this->hashPolicy.hashMany(messages.data(), (unsigned int) len, (unsigned int) messages.size(), computed.data());
+        } else {
+            for (std::size_t i = 0; i < computed.size(); i++)
+                computed[i] = this->hashPolicy.hash(std::as_bytes(std::span(inputs[group].data() + i * len, len)));
+        }
         
-        order.pop();
+        for (std::size_t i = 0; i < computed.size(); i++) {
+            if(computed[i] != nodes[group][i]->hash.load())
+                result = false;
+        }
     }
     return result;
 }
@@ -0,0 +1,381 @@
+//
+//  Reclaimer.h
+//  ConcurrentMerkle
+//
+//  Safe memory reclamation for the lock free tree.
+//
+
+#ifndef RECLAIMER_H
+#define RECLAIMER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A Reclaimer decides when memory unlinked from the tree (replaced descriptors, removed nodes) can be freed. Every
+ * reclaimer provides
+ *  - Guard                     constructed at the start of an operation and destroyed at its end
+ *  - Guard::protect(src, slot) loads a pointer from an atomic and keeps the object alive while it sits in the slot
+ *  - Guard::set(slot, p)       moves a pointer that is already protected by another slot into slot
+ *  - Guard::retire(p)          hands over an object that has been unlinked, it is deleted once no guard can reach it
+ *  - Guard::retire(p, deleter) the same with a custom deleter, for objects that own more than their own memory
+ * Slots are numbered from 0 to Guard::SLOTS - 1, reclaimers that protect the whole operation ignore them.
+ */
+
+// An unlinked object waiting to be freed, tag is reclaimer specific
+struct RetiredObject {
+    void* ptr;
+    void (*deleter)(void*);
+    std::uint64_t tag;
+
+    template<typename P>
+    static RetiredObject of(P* p, std::uint64_t tag) {
+        return {p, [](void* q) { delete static_cast<P*>(q); }, tag};
+    };
+
+    template<typename P>
+    static RetiredObject of(P* p, void (*deleter)(void*), std::uint64_t tag) { return {p, deleter, tag}; };
+};
+
+/**
+ * Class RecordList
+ * The per-thread records of a reclaimer. A thread borrows a record for the length of an operation: records are
+ * claimed with a CAS on inUse and a thread_local hint makes the record used last the first one tried. Records are
+ * only freed with the list, so a retire list outlives the thread that filled it.
+ * Record needs std::atomic<bool> inUse, Record* next and std::vector<RetiredObject> retired.
+ */
+template<typename Record>
+class RecordList {
+public:
+    RecordList() : id(nextId.fetch_add(1) + 1) {};
+
+    // Frees every record and everything still retired, no thread may hold a record.
+    ~RecordList() {
+        Record* r = this->records.load();
+        while (r != nullptr) {
+            for (RetiredObject& item : r->retired)
+                item.deleter(item.ptr);
+            Record* next = r->next;
+            delete r;
+            r = next;
+        }
+    };
+
+    RecordList(const RecordList&) = delete;
+    RecordList& operator=(const RecordList&) = delete;
+
+    Record* acquire() {
+        thread_local struct { std::uint64_t id; Record* record; } hint = {0, nullptr};
+        if (hint.id == this->id && !hint.record->inUse.load(std::memory_order_relaxed) &&
+            !hint.record->inUse.exchange(true, std::memory_order_acquire))
+            return hint.record;
+
+        Record* r = this->records.load(std::memory_order_acquire);
+        for (; r != nullptr; r = r->next) {
+            if (!r->inUse.load(std::memory_order_relaxed) && !r->inUse.exchange(true, std::memory_order_acquire))
+                break;
+        }
+        if (r == nullptr) {
+            r = new Record();
+            r->inUse.store(true, std::memory_order_relaxed);
+            Record* head = this->records.load(std::memory_order_relaxed);
+            do {
+                r->next = head;
+            } while (!this->records.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+            this->count.fetch_add(1);
+        }
+        hint = {this->id, r};
+        return r;
+    };
+
+    void release(Record* r) { r->inUse.store(false, std::memory_order_release); };
+
+    Record* head() const { return this->records.load(); };
+
+    std::size_t size() const { return this->count.load(); };
+
+private:
+    std::atomic<Record*> records{nullptr};
+    std::atomic<std::size_t> count{0};
+    // distinguishes lists in the thread_local hint, ids are never reused while addresses may be
+    const std::uint64_t id;
+    inline static std::atomic<std::uint64_t> nextId{0};
+};
+
+/**
+ * Class EpochReclaimer
+ * Epoch based reclamation. A global epoch counter is advanced by the operations themselves, every thread announces
+ * the epoch it entered at and retired objects are tagged with the epoch they were retired in. Once the global epoch
+ * is two ahead of the tag every thread that could have seen the object has left, and it is freed.
+ *
+ * Cheap per access (protect is a plain load), but a thread stalled inside an operation stops the epoch from
+ * advancing and nothing retired after that is freed until it resumes.
+ */
+class EpochReclaimer {
+    struct Record {
+        // (epoch << 1) | 1 while the owner is inside an operation, 0 while quiescent
+        std::atomic<std::uint64_t> announced{0};
+        std::atomic<bool> inUse{false};
+        Record* next = nullptr;
+        std::vector<RetiredObject> retired;
+        unsigned int sinceScan = 0;
+    };
+
+public:
+    // number of retires between attempts to advance the epoch and free this record's list
+    static const unsigned int SCAN_INTERVAL = 64;
+
+    class Guard {
+    public:
+        // slots are not used, any number is accepted
+        static const unsigned int SLOTS = ~0u;
+
+        Guard(EpochReclaimer& r) : reclaimer(r), record(r.records.acquire()) { this->reclaimer.enter(this->record); };
+
+        ~Guard() {
+            this->reclaimer.exit(this->record);
+            this->reclaimer.records.release(this->record);
+        };
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        template<typename P>
+        P* protect(const std::atomic<P*>& src, unsigned int) { return src.load(); };
+
+        template<typename P>
+        void set(unsigned int, P*) {};
+
+        template<typename P>
+        void retire(P* p) {
+            if (p != nullptr)
+                this->reclaimer.retire(this->record, RetiredObject::of(p, 0));
+        };
+
+        template<typename P>
+        void retire(P* p, void (*deleter)(void*)) {
+            if (p != nullptr)
+                this->reclaimer.retire(this->record, RetiredObject::of(p, deleter, 0));
+        };
+
+    private:
+        EpochReclaimer& reclaimer;
+        Record* record;
+    };
+
+    EpochReclaimer() {};
+
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+private:
+    std::atomic<std::uint64_t> epoch{0};
+    RecordList<Record> records;
+
+    // The announcement has to be visible before any pointer of the operation is read.
+    void enter(Record* r) {
+        r->announced.store((this->epoch.load() << 1) | 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    };
+
+    void exit(Record* r) { r->announced.store(0, std::memory_order_release); };
+
+    void retire(Record* r, RetiredObject item) {
+        item.tag = this->epoch.load();
+        r->retired.push_back(item);
+        if (++r->sinceScan >= SCAN_INTERVAL) {
+            r->sinceScan = 0;
+            this->tryAdvance();
+            this->collect(r);
+        }
+    };
+
+    // Moves the epoch forward if every thread inside an operation has announced the current one.
+    void tryAdvance() {
+        std::uint64_t current = this->epoch.load();
+        for (Record* r = this->records.head(); r != nullptr; r = r->next) {
+            std::uint64_t announced = r->announced.load();
+            if ((announced & 1) && (announced >> 1) != current)
+                return;
+        }
+        this->epoch.compare_exchange_strong(current, current + 1);
+    };
+
+    // Retire lists are in epoch order, frees the prefix that is two or more epochs old.
+    void collect(Record* r) {
+        std::uint64_t current = this->epoch.load();
+        std::size_t done = 0;
+        while (done < r->retired.size() && r->retired[done].tag + 2 <= current) {
+            r->retired[done].deleter(r->retired[done].ptr);
+            done++;
+        }
+        r->retired.erase(r->retired.begin(), r->retired.begin() + done);
+    };
+};
+
+/**
+ * Class HazardReclaimer
+ * Hazard pointers. Every pointer an operation dereferences is first published in one of its record's slots, a
+ * retired object is only freed by a scan that finds it in no slot. A thread can pin at most SLOTS objects no matter
+ * how long it stalls, so a scan keeps at most one object for every slot in use.
+ *
+ * The slots in use are those below the highest slot a guard of each record has written so far, summed over the
+ * records. A scan only reads those, and a record's list is scanned once it holds 2 * (slots in use) + SCAN_BASE
+ * objects. A scan so frees at least as many objects as it reads slots, which makes the cost per retired object
+ * constant, and with P records no more than P * (2 * (slots in use) + SCAN_BASE) objects wait to be freed.
+ *
+ * A record has enough slots for a tree operation to keep every node of a root to leaf path of a 256 bit key pinned
+ * (two per level), a guard only clears the slots it used.
+ */
+class HazardReclaimer {
+    static const unsigned int RECORD_SLOTS = 528;
+
+    struct Record {
+        std::atomic<void*> hazards[RECORD_SLOTS] = {};
+        // one past the highest slot a guard of this record has written
+        std::atomic<unsigned int> reach{0};
+        std::atomic<bool> inUse{false};
+        Record* next = nullptr;
+        std::vector<RetiredObject> retired;
+    };
+
+public:
+    static const std::size_t SCAN_BASE = 64;
+
+    class Guard {
+    public:
+        static const unsigned int SLOTS = RECORD_SLOTS;
+
+        Guard(HazardReclaimer& r) : reclaimer(r), record(r.records.acquire()) {};
+
+        ~Guard() {
+            for (unsigned int i = 0; i < this->used; i++)
+                this->record->hazards[i].store(nullptr, std::memory_order_release);
+            this->reclaimer.records.release(this->record);
+        };
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        // Publishes the pointer and reloads until the published value is still the current one.
+        template<typename P>
+        P* protect(const std::atomic<P*>& src, unsigned int slot) {
+            this->use(slot);
+            P* p = src.load();
+            while (true) {
+                this->record->hazards[slot].store(p);
+                P* again = src.load();
+                if (again == p)
+                    return p;
+                p = again;
+            }
+        };
+
+        template<typename P>
+        void set(unsigned int slot, P* p) {
+            this->use(slot);
+            this->record->hazards[slot].store(p);
+        };
+
+        template<typename P>
+        void retire(P* p) {
+            if (p != nullptr)
+                this->reclaimer.retire(this->record, RetiredObject::of(p, 0));
+        };
+
+        template<typename P>
+        void retire(P* p, void (*deleter)(void*)) {
+            if (p != nullptr)
+                this->reclaimer.retire(this->record, RetiredObject::of(p, deleter, 0));
+        };
+
+    private:
+        HazardReclaimer& reclaimer;
+        Record* record;
+        // one past the highest slot written
+        unsigned int used = 0;
+
+        // Raises the reach of the record before the slot is written, a scan that reads the old reach runs before the
+        // pointer is published and its object is already out of the tree when protect checks it again.
+        void use(unsigned int slot) {
+            if (slot < this->used)
+                return;
+            this->used = slot + 1;
+            unsigned int reach = this->record->reach.load(std::memory_order_relaxed);
+            if (this->used > reach) {
+                this->reclaimer.reached.fetch_add(this->used - reach);
+                this->record->reach.store(this->used);
+            }
+        };
+    };
+
+    HazardReclaimer() {};
+
+    HazardReclaimer(const HazardReclaimer&) = delete;
+    HazardReclaimer& operator=(const HazardReclaimer&) = delete;
+
+private:
+    RecordList<Record> records;
+    // the reach of every record summed, the slots in use
+    std::atomic<std::size_t> reached{0};
+
+    void retire(Record* r, RetiredObject item) {
+        r->retired.push_back(item);
+        if (r->retired.size() >= 2 * this->reached.load(std::memory_order_relaxed) + SCAN_BASE)
+            this->scan(r);
+    };
+
+    // Frees every object of the record's list that no slot currently holds.
+    void scan(Record* r) {
+        std::vector<void*> hazards;
+        for (Record* other = this->records.head(); other != nullptr; other = other->next) {
+            unsigned int reach = other->reach.load();
+            for (unsigned int i = 0; i < reach; i++) {
+                void* p = other->hazards[i].load();
+                if (p != nullptr)
+                    hazards.push_back(p);
+            }
+        }
+        std::sort(hazards.begin(), hazards.end());
+
+        std::size_t kept = 0;
+        for (RetiredObject& item : r->retired) {
+            if (std::binary_search(hazards.begin(), hazards.end(), item.ptr))
+                r->retired[kept++] = item;
+            else
+                item.deleter(item.ptr);
+        }
+        r->retired.resize(kept);
+    };
+};
+
+/**
+ * Class LeakingReclaimer
+ * Never frees anything. The baseline the reclamation overhead is measured against.
+ */
+class LeakingReclaimer {
+public:
+    class Guard {
+    public:
+        static const unsigned int SLOTS = ~0u;
+
+        Guard(LeakingReclaimer&) {};
+
+        template<typename P>
+        P* protect(const std::atomic<P*>& src, unsigned int) { return src.load(); };
+
+        template<typename P>
+        void set(unsigned int, P*) {};
+
+        template<typename P>
+        void retire(P*) {};
+
+        template<typename P>
+        void retire(P*, void (*)(void*)) {};
+    };
+};
+
+#endif //RECLAIMER_H
@@ -9,6 +9,12 @@
 #define SequentialMerkle_h
 
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "Digest.h"
+#include "HashPolicy.h"
+#include "Serializer.h"
 
 namespace Sequential {
 
@@ -16,13 +22,19 @@ enum Direction { LEFT, RIGHT };
 enum NodeType { HASH, DATA };
 
 
-template<typename T>
+template<typename T, typename HashPolicy = Sha256Policy, KeyMode Mode = KeyMode::STD_HASH>
 class MerkleTree {
 public:
     class MerkleNode;
+    typedef typename HashPolicy::digest_type digest_type;
+    typedef std::conditional_t<Mode == KeyMode::DIGEST_BITS, DigestKey<digest_type::SIZE>, std::size_t> key_type;
     
-    MerkleTree(std::string (*hash_func)(std::string)) {
-        this->hashFunc = hash_func;
+    MerkleTree(HashPolicy policy = HashPolicy()) : hashPolicy(policy) {
+        this->root = new MerkleNode();
+    };
+    
+    MerkleTree(std::string (*hash_func)(std::string)) requires std::is_constructible_v<HashPolicy, std::string (*)(std::string)>
+        : hashPolicy(hash_func) {
         this->root = new MerkleNode();
     };
     
@@ -31,26 +43,23 @@ public:
     };
     
     
-    std::string getRootValue(){ return this->root->hash; };
+    std::string getRootValue(){ return this->root->hash.hex(); };
     
     // Inserts a value into the tree
     void insert(T v) {
         this->lock.lock();
-        std::string hash = hashFunc(std::to_string(*v));
-        size_t key = gen_key(hash);
-        this->update(this->root, hash, key, v);
+        digest_type hash = leafHash(v);
+        this->update(this->root, 0, hash, routeKey(hash), v);
         this->lock.unlock();
     };
     
-    // Removes a value into the tree
-    void remove(T v) {
+    // Removes a value from the tree, returns false if it was not in the tree
+    bool remove(T v) {
         this->lock.lock();
-        std::string* hash = hashFunc(std::to_string(v));
-        size_t key = gen_key(*hash);
-        // TODO: this is probably wrong, will need to debug later
-        T temp = NULL;
-        this->update(this->root, "", key, temp);
+        digest_type hash = leafHash(v);
+        bool result = this->erase(this->root, hash, routeKey(hash));
         this->lock.unlock();
+        return result;
     };
 
     bool validate() {
@@ -63,9 +72,8 @@ public:
     // checks if a value is in the tree.
     bool contains(T val) {
         this->lock.lock();
-        std::string hash = hashFunc(std::to_string(*val));
-        size_t key = gen_key(hash);
-        bool result = this->contains(this->root, hash, key);
+        digest_type hash = leafHash(val);
+        bool result = this->contains(this->root, hash, routeKey(hash));
         this->lock.unlock();
         return result;
     };
@@ -77,12 +85,30 @@ public:
 private:
     MerkleNode* root;
     std::mutex lock;
-    std::string (*hashFunc)(std::string);
-    std::hash<std::string> gen_key;
+    HashPolicy hashPolicy;
+    std::hash<std::string_view> gen_key;
+
+    digest_type leafHash(const T& value) const { return serializeHash(this->hashPolicy, value); };
+
+    key_type routeKey(const digest_type& hash) const {
+        if constexpr (Mode == KeyMode::DIGEST_BITS)
+            return key_type(hash);
+        else
+            return this->gen_key(std::string_view((const char*) hash.bytes, digest_type::SIZE));
+    };
 
-    void update(MerkleNode* walker, std::string hash, size_t key, T val);
-    bool contains(MerkleNode* walker, std::string hash, std::size_t key);
+    key_type routeKey(const digest_type& hash, unsigned int depth) const {
+        if constexpr (Mode == KeyMode::DIGEST_BITS)
+            return routeKey(hash) >> depth;
+        else
+            return depth < 64 ? routeKey(hash) >> depth : 0;
+    };
+
+    void update(MerkleNode* walker, unsigned int depth, const digest_type& hash, key_type key, T val);
+    bool erase(MerkleNode* walker, const digest_type& hash, key_type key);
+    bool contains(MerkleNode* walker, const digest_type& hash, key_type key);
     bool validate(MerkleNode* node);
+    digest_type hashChildren(MerkleNode* node);
     
     void print_values(MerkleNode* node) {
         if (node != nullptr) {
@@ -95,31 +121,30 @@ private:
     }
     
     void post_delete(MerkleNode* node) {
-        if (node == nullptr) {
+        if (node != nullptr) {
             post_delete(node->left);
             post_delete(node->right);
+            if(node->type == DATA)
+                delete node->val;
             delete node;
         }
     }
 };
 
-template<typename T>
-class MerkleTree<T>::MerkleNode {
+template<typename T, typename HashPolicy, KeyMode Mode>
+class MerkleTree<T, HashPolicy, Mode>::MerkleNode {
 public:
     
-    MerkleNode(std::string _hash, size_t key, T &v) {
+    MerkleNode(const digest_type& _hash, T &v) {
         this->val = v;
         this->hash = _hash;
-        this->key = key;
         this->type = DATA;
         this->left = nullptr;
         this->right = nullptr;
     };
     
     MerkleNode() {
-        this->hash = "";
         this->val = NULL;
-        this->key = 0;
         this->type = HASH;
         this->left = nullptr;
         this->right = nullptr;
@@ -128,20 +153,19 @@ public:
     ~MerkleNode() {};
     
     T val;
-    std::size_t key;
     NodeType type;
-    std::string hash;
+    digest_type hash;
     MerkleNode* left;
     MerkleNode* right;
 };
 
-template<typename T>
-bool MerkleTree<T>::contains(MerkleNode* walker, std::string hash, std::size_t key) {
+template<typename T, typename HashPolicy, KeyMode Mode>
+bool MerkleTree<T, HashPolicy, Mode>::contains(MerkleNode* walker, const digest_type& hash, key_type key) {
     if (walker == nullptr)
         return false;
     
     if (walker->type == DATA) {
-        if(hash.compare(walker->hash) == 0)
+        if(hash == walker->hash)
             return true;
         else
             return false;
@@ -160,8 +184,8 @@ bool MerkleTree<T>::contains(MerkleNode* walker, std::string hash, std::size_t k
     return true & false;
 }
 
-template<typename T>
-void MerkleTree<T>::update(MerkleNode* walker, std::string hash, std::size_t key, T val) {
+template<typename T, typename HashPolicy, KeyMode Mode>
+void MerkleTree<T, HashPolicy, Mode>::update(MerkleNode* walker, unsigned int depth, const digest_type& hash, key_type key, T val) {
     Direction dir;
     MerkleNode* next;
     MerkleNode* newNode;
@@ -179,17 +203,18 @@ void MerkleTree<T>::update(MerkleNode* walker, std::string hash, std::size_t key
     if(next == nullptr) {
         switch(dir) {
             case LEFT :
-                walker->left = new MerkleNode(hash, key >> 1, val);
+                walker->left = new MerkleNode(hash, val);
                 break;
             case RIGHT :
-                walker->right = new MerkleNode(hash, key >> 1, val);
+                walker->right = new MerkleNode(hash, val);
                 break;
         }
     } else {
         switch(next->type) {
             case DATA :
                 newNode = new MerkleNode();
-                switch(next->key % 2) {
+                // newNode takes next's place one level down, next's key is rebuilt from its digest
+                switch(routeKey(next->hash, depth + 1) % 2) {
                     case LEFT :
                         newNode->left = next;
                         break;
@@ -197,8 +222,6 @@ void MerkleTree<T>::update(MerkleNode* walker, std::string hash, std::size_t key
                         newNode->right = next;
                         break;
                 }
-                next->key >>= 1;
-                
                 switch(dir) {
                     case LEFT :
                         walker->left = newNode;
@@ -208,29 +231,66 @@ void MerkleTree<T>::update(MerkleNode* walker, std::string hash, std::size_t key
                         break;
                 }
                 
-                this->update(newNode, hash, key >> 1, val);
+                this->update(newNode, depth + 1, hash, key >> 1, val);
                 break;
 
             case HASH :
-                this->update(next, hash, key >> 1, val);
+                this->update(next, depth + 1, hash, key >> 1, val);
                 break;
         }
     }
-        
-    std::string newHash = "";
-    // obtain the hashes from the child nodes
-    if(walker->left != nullptr)
-        newHash += walker->left->hash;
+    
+    // compute the new hash from the child nodes
+    walker->hash = hashChildren(walker);
+}
 
-    if(walker->right != nullptr)
-        newHash += walker->right->hash;
+// A HASH node other than the root is only kept while two or more values sit below it, the same shape inserting the
+// remaining values would have given the tree.
+template<typename T, typename HashPolicy, KeyMode Mode>
+bool MerkleTree<T, HashPolicy, Mode>::erase(MerkleNode* walker, const digest_type& hash, key_type key) {
+    MerkleNode*& next = key % 2 == LEFT ? walker->left : walker->right;
+    if(next == nullptr)
+        return false;
+    
+    if(next->type == DATA) {
+        if(next->hash != hash)
+            return false;
+        delete next->val;
+        delete next;
+        next = nullptr;
+    } else {
+        if(!this->erase(next, hash, key >> 1))
+            return false;
+        if(next->left == nullptr || next->right == nullptr) {
+            MerkleNode* only = next->left != nullptr ? next->left : next->right;
+            if(only == nullptr || only->type == DATA) {
+                delete next;
+                next = only;
+            }
+        }
+    }
     
-    // compute the new hashes
-    walker->hash = hashFunc(newHash);
+    walker->hash = hashChildren(walker);
+    return true;
 }
 
-template<typename T>
-bool MerkleTree<T>::validate(MerkleNode* node) {
+// Hashes the binary digests of the children of an interior node, an empty node hashes to all zeros.
+template<typename T, typename HashPolicy, KeyMode Mode>
+typename MerkleTree<T, HashPolicy, Mode>::digest_type MerkleTree<T, HashPolicy, Mode>::hashChildren(MerkleNode* node) {
+    if(node->left != nullptr && node->right != nullptr)
+        return this->hashPolicy.combine(node->left->hash, node->right->hash);
+
+    if(node->left != nullptr)
+        return this->hashPolicy.combine(node->left->hash);
+
+    if(node->right != nullptr)
+        return this->hashPolicy.combine(node->right->hash);
+
+    return digest_type();
+}
+
+template<typename T, typename HashPolicy, KeyMode Mode>
+bool MerkleTree<T, HashPolicy, Mode>::validate(MerkleNode* node) {
     if (node == nullptr)
         return true;
     if(!validate(node->left))
@@ -238,26 +298,18 @@ bool MerkleTree<T>::validate(MerkleNode* node) {
     if(!validate(node->right))
         return false;
     
-    std::string newHash = "";
+    digest_type newHash;
 
     switch(node->type) {
         case DATA :
-            newHash = sha256(std::to_string(*node->val));
+            newHash = leafHash(node->val);
             break;
         case HASH :
-            // obtain the hashes from the child nodes
-            if(node->left != nullptr)
-                newHash += node->left->hash;
-
-            if(node->right != nullptr)
-                newHash += node->right->hash;
-            
-            // compute the new hashes
-            newHash = hashFunc(newHash);
+            newHash = hashChildren(node);
             break;
     }
     
-    if(newHash.compare(node->hash) != 0)
+    if(newHash != node->hash)
         return false;
     else
         return true;
@@ -0,0 +1,112 @@
+//
+//  Serializer.h
+//  ConcurrentMerkle
+//
+//  Canonical byte encodings of the values stored in the trees.
+//
+
+#ifndef SERIALIZER_H
+#define SERIALIZER_H
+
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/**
+ * MerkleSerializer<T> is the customization point that turns a stored value into the bytes its leaf digest is computed
+ * over. A specialization provides one or both of
+ *  - view(v)          the canonical bytes as a std::span<const std::byte> into v itself, no copy
+ *  - size(v)/write(v, out)   the length of the encoding and a function writing it into a caller provided buffer
+ * The trees use view() when it exists. Built in specializations cover integers (fixed width little endian), strings,
+ * trivially copyable types without padding (their object bytes) and pointers to any of these (the pointee is
+ * serialized, the trees store int* and friends).
+ */
+template<typename T, typename Enable = void>
+struct MerkleSerializer;
+
+// Integers are encoded as their fixed width little endian bytes, on little endian hosts that is the object itself.
+template<typename T>
+struct MerkleSerializer<T, std::enable_if_t<std::is_integral_v<T>>> {
+    static std::span<const std::byte> view(const T& v) requires (std::endian::native == std::endian::little) {
+        return std::as_bytes(std::span(&v, 1));
+    };
+
+    static std::size_t size(const T&) { return sizeof(T); };
+
+    static void write(const T& v, std::byte* out) {
+        std::make_unsigned_t<T> u = v;
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            out[i] = (std::byte) (u & 0xff);
+            u = (std::make_unsigned_t<T>) (u >> 8);
+        }
+    };
+};
+
+template<>
+struct MerkleSerializer<std::string> {
+    static std::span<const std::byte> view(const std::string& v) { return std::as_bytes(std::span(v.data(), v.size())); };
+};
+
+template<>
+struct MerkleSerializer<std::string_view> {
+    static std::span<const std::byte> view(const std::string_view& v) { return std::as_bytes(std::span(v.data(), v.size())); };
+};
+
+/**
+ * Records are hashed as their object bytes. Only types with unique object representations qualify, padding bytes or
+ * floating point values with several encodings of the same value (0.0 / -0.0) would give equal values different
+ * digests. Anything else needs its own specialization.
+ */
+template<typename T>
+struct MerkleSerializer<T, std::enable_if_t<!std::is_integral_v<T> && !std::is_pointer_v<T> &&
+                                            std::is_trivially_copyable_v<T> &&
+                                            std::has_unique_object_representations_v<T>>> {
+    static std::span<const std::byte> view(const T& v) { return std::as_bytes(std::span(&v, 1)); };
+};
+
+// The trees store pointers, the value pointed to is what gets hashed.
+template<typename T>
+struct MerkleSerializer<T*> {
+    typedef MerkleSerializer<std::remove_cv_t<T>> inner;
+
+    static std::span<const std::byte> view(T* const& v) requires requires(const T& x) { inner::view(x); } {
+        return inner::view(*v);
+    };
+
+    static std::size_t size(T* const& v) requires requires(const T& x) { inner::size(x); } {
+        return inner::size(*v);
+    };
+
+    static void write(T* const& v, std::byte* out) requires requires(const T& x, std::byte* o) { inner::write(x, o); } {
+        inner::write(*v, out);
+    };
+};
+
+/**
+ * Hashes the canonical bytes of a value with the given policy. Encodings without a view() are written into a stack
+ * buffer, only values longer than that fall back to the heap.
+ */
+template<typename HashPolicy, typename T>
+typename HashPolicy::digest_type serializeHash(const HashPolicy& policy, const T& v) {
+    typedef MerkleSerializer<T> serializer;
+    if constexpr (requires { serializer::view(v); }) {
+        return policy.hash(serializer::view(v));
+    } else {
+        std::size_t len = serializer::size(v);
+        std::byte buffer[256];
+        if (len <= sizeof(buffer)) {
+            serializer::write(v, buffer);
+            return policy.hash(std::span<const std::byte>(buffer, len));
+        }
+        std::vector<std::byte> heap(len);
+        serializer::write(v, heap.data());
+        return policy.hash(std::span<const std::byte>(heap.data(), len));
+    }
+}
+
+#endif //SERIALIZER_H
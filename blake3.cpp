@@ -0,0 +1,629 @@
+#include <cstdio>
+#include <cstring>
+#include "blake3.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef unsigned char uint8;
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+enum blake3_flags {
+    CHUNK_START = 1 << 0,
+    CHUNK_END = 1 << 1,
+    PARENT = 1 << 2,
+    ROOT = 1 << 3,
+};
+
+static const uint32 blake3_iv[8] =
+            {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint8 blake3_permutation[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+// Message word order for each of the seven rounds, round r + 1 is round r with the permutation applied.
+struct blake3_message_schedule {
+    uint8 order[7][16];
+
+    constexpr blake3_message_schedule() : order()
+    {
+        for (int i = 0; i < 16; i++)
+            order[0][i] = (uint8) i;
+        for (int r = 1; r < 7; r++) {
+            for (int i = 0; i < 16; i++)
+                order[r][i] = order[r - 1][blake3_permutation[i]];
+        }
+    }
+};
+
+static constexpr blake3_message_schedule blake3_schedule;
+
+static inline uint32 blake3_load32(const uint8 *p)
+{
+    return ((uint32) p[0]) | ((uint32) p[1] << 8) | ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+static inline void blake3_store_cv(const uint32 cv[8], uint8 *out)
+{
+    for (int i = 0; i < 8; i++) {
+        out[4 * i + 0] = (uint8) (cv[i]);
+        out[4 * i + 1] = (uint8) (cv[i] >> 8);
+        out[4 * i + 2] = (uint8) (cv[i] >> 16);
+        out[4 * i + 3] = (uint8) (cv[i] >> 24);
+    }
+}
+
+/*
+ * Portable kernels
+ */
+
+#define BLAKE3_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define BLAKE3_G(s, a, b, c, d, x, y)                         \
+{                                                             \
+    s[a] = s[a] + s[b] + (x);                                 \
+    s[d] = BLAKE3_ROTR(s[d] ^ s[a], 16);                      \
+    s[c] = s[c] + s[d];                                       \
+    s[b] = BLAKE3_ROTR(s[b] ^ s[c], 12);                      \
+    s[a] = s[a] + s[b] + (y);                                 \
+    s[d] = BLAKE3_ROTR(s[d] ^ s[a], 8);                       \
+    s[c] = s[c] + s[d];                                       \
+    s[b] = BLAKE3_ROTR(s[b] ^ s[c], 7);                       \
+}
+
+// Compresses one block into the chaining value cv (in place), only the first 8 output words are kept.
+static void blake3_compress_portable(uint32 cv[8], const uint8 block[64], uint8 block_len, uint64 counter,
+                                     uint8 flags)
+{
+    uint32 m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = blake3_load32(block + 4 * i);
+    uint32 s[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                    blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+                    (uint32) counter, (uint32) (counter >> 32), (uint32) block_len, (uint32) flags};
+    for (int r = 0; r < 7; r++) {
+        const uint8 *o = blake3_schedule.order[r];
+        BLAKE3_G(s, 0, 4, 8, 12, m[o[0]], m[o[1]]);
+        BLAKE3_G(s, 1, 5, 9, 13, m[o[2]], m[o[3]]);
+        BLAKE3_G(s, 2, 6, 10, 14, m[o[4]], m[o[5]]);
+        BLAKE3_G(s, 3, 7, 11, 15, m[o[6]], m[o[7]]);
+        BLAKE3_G(s, 0, 5, 10, 15, m[o[8]], m[o[9]]);
+        BLAKE3_G(s, 1, 6, 11, 12, m[o[10]], m[o[11]]);
+        BLAKE3_G(s, 2, 7, 8, 13, m[o[12]], m[o[13]]);
+        BLAKE3_G(s, 3, 4, 9, 14, m[o[14]], m[o[15]]);
+    }
+    for (int i = 0; i < 8; i++)
+        cv[i] = s[i] ^ s[i + 8];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * SSE4.1 kernel, one compression with the 4x4 state held as four row vectors. The column step runs the four G
+ * functions at once, the rows are then rotated so the diagonals line up as columns for the second step.
+ */
+__attribute__((target("sse4.1")))
+static void blake3_compress_sse41(uint32 cv[8], const uint8 block[64], uint8 block_len, uint64 counter,
+                                  uint8 flags)
+{
+    const __m128i rot8 = _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+    const __m128i rot16 = _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    uint32 m[16];
+    memcpy(m, block, 64);
+
+    __m128i r0 = _mm_loadu_si128((const __m128i *) &cv[0]);
+    __m128i r1 = _mm_loadu_si128((const __m128i *) &cv[4]);
+    __m128i r2 = _mm_loadu_si128((const __m128i *) &blake3_iv[0]);
+    __m128i r3 = _mm_set_epi32((int) flags, (int) block_len, (int) (counter >> 32), (int) counter);
+
+#define BLAKE3_G4(mx, my)                                                                        \
+    {                                                                                            \
+        r0 = _mm_add_epi32(_mm_add_epi32(r0, r1), mx);                                           \
+        r3 = _mm_shuffle_epi8(_mm_xor_si128(r3, r0), rot16);                                     \
+        r2 = _mm_add_epi32(r2, r3);                                                              \
+        r1 = _mm_xor_si128(r1, r2);                                                              \
+        r1 = _mm_or_si128(_mm_srli_epi32(r1, 12), _mm_slli_epi32(r1, 20));                       \
+        r0 = _mm_add_epi32(_mm_add_epi32(r0, r1), my);                                           \
+        r3 = _mm_shuffle_epi8(_mm_xor_si128(r3, r0), rot8);                                      \
+        r2 = _mm_add_epi32(r2, r3);                                                              \
+        r1 = _mm_xor_si128(r1, r2);                                                              \
+        r1 = _mm_or_si128(_mm_srli_epi32(r1, 7), _mm_slli_epi32(r1, 25));                        \
+    }
+
+    for (int r = 0; r < 7; r++) {
+        const uint8 *o = blake3_schedule.order[r];
+        BLAKE3_G4(_mm_set_epi32((int) m[o[6]], (int) m[o[4]], (int) m[o[2]], (int) m[o[0]]),
+                  _mm_set_epi32((int) m[o[7]], (int) m[o[5]], (int) m[o[3]], (int) m[o[1]]));
+        // diagonalize
+        r1 = _mm_shuffle_epi32(r1, 0x39);
+        r2 = _mm_shuffle_epi32(r2, 0x4E);
+        r3 = _mm_shuffle_epi32(r3, 0x93);
+        BLAKE3_G4(_mm_set_epi32((int) m[o[14]], (int) m[o[12]], (int) m[o[10]], (int) m[o[8]]),
+                  _mm_set_epi32((int) m[o[15]], (int) m[o[13]], (int) m[o[11]], (int) m[o[9]]));
+        // undiagonalize
+        r1 = _mm_shuffle_epi32(r1, 0x93);
+        r2 = _mm_shuffle_epi32(r2, 0x4E);
+        r3 = _mm_shuffle_epi32(r3, 0x39);
+    }
+#undef BLAKE3_G4
+
+    _mm_storeu_si128((__m128i *) &cv[0], _mm_xor_si128(r0, r2));
+    _mm_storeu_si128((__m128i *) &cv[4], _mm_xor_si128(r1, r3));
+}
+
+#endif
+
+typedef void (*blake3_compress_fn)(uint32 *, const uint8 *, uint8, uint64, uint8);
+
+/**
+ * Multi-buffer kernels
+ *
+ * Each lane hashes one input of len bytes (at most one chunk) starting from key. The counter of lane l is
+ * counter + l when increment is set (consecutive chunks of one message), the first and last block of every lane
+ * additionally get flags_start and flags_end. This covers both runs of whole chunks in tree mode and many
+ * independent short messages.
+ */
+struct blake3_lane_job {
+    const uint8 *const *inputs;
+    unsigned int len;
+    const uint32 *key;
+    uint64 counter;
+    bool increment;
+    uint8 flags;
+    uint8 flags_start;
+    uint8 flags_end;
+};
+
+// Block count and length of the final block, an empty input is still one (empty) block
+static inline unsigned int blake3_block_count(unsigned int len, unsigned int *last_len)
+{
+    unsigned int block_nb = len == 0 ? 1 : (len + 63) / 64;
+    *last_len = len - 64 * (block_nb - 1);
+    return block_nb;
+}
+
+// One lane of a job through a single block compression function, used for leftovers and as the portable path
+static void blake3_hash_one(const blake3_lane_job &job, unsigned int lane, blake3_compress_fn compress,
+                            uint8 *out)
+{
+    unsigned int last_len;
+    unsigned int block_nb = blake3_block_count(job.len, &last_len);
+    uint64 counter = job.counter + (job.increment ? lane : 0);
+    uint32 cv[8];
+    memcpy(cv, job.key, sizeof(cv));
+    for (unsigned int b = 0; b < block_nb; b++) {
+        uint8 flags = job.flags;
+        if (b == 0)
+            flags |= job.flags_start;
+        if (b == block_nb - 1)
+            flags |= job.flags_end;
+        if (b == block_nb - 1 && last_len < 64) {
+            uint8 block[64] = {0};
+            memcpy(block, job.inputs[lane] + 64 * b, last_len);
+            compress(cv, block, (uint8) last_len, counter, flags);
+        } else {
+            compress(cv, job.inputs[lane] + 64 * b, 64, counter, flags);
+        }
+    }
+    blake3_store_cv(cv, out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define BLAKE3_V8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define BLAKE3_V8_G(a, b, c, d, x, y)                                                            \
+    {                                                                                            \
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);                                \
+        v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16);                         \
+        v[c] = _mm256_add_epi32(v[c], v[d]);                                                     \
+        v[b] = BLAKE3_V8_ROTR(_mm256_xor_si256(v[b], v[c]), 12);                                 \
+        v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);                                \
+        v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot8);                          \
+        v[c] = _mm256_add_epi32(v[c], v[d]);                                                     \
+        v[b] = BLAKE3_V8_ROTR(_mm256_xor_si256(v[b], v[c]), 7);                                  \
+    }
+
+// Eight inputs per call, the state is transposed so that word i of every lane sits in one ymm register.
+__attribute__((target("avx2")))
+static void blake3_many_avx2(const blake3_lane_job &job, uint8 *out)
+{
+    const __m256i rot8 = _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+                                         12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    unsigned int last_len;
+    unsigned int block_nb = blake3_block_count(job.len, &last_len);
+    uint8 tail[8][64];
+    for (int l = 0; l < 8; l++) {
+        memset(tail[l], 0, 64);
+        memcpy(tail[l], job.inputs[l] + 64 * (block_nb - 1), last_len);
+    }
+
+    alignas(32) uint32 ctr_lo[8], ctr_hi[8];
+    for (int l = 0; l < 8; l++) {
+        uint64 c = job.counter + (job.increment ? l : 0);
+        ctr_lo[l] = (uint32) c;
+        ctr_hi[l] = (uint32) (c >> 32);
+    }
+
+    __m256i h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi32((int) job.key[i]);
+
+    for (unsigned int b = 0; b < block_nb; b++) {
+        const uint8 *p[8];
+        for (int l = 0; l < 8; l++)
+            p[l] = b == block_nb - 1 ? tail[l] : job.inputs[l] + 64 * b;
+        __m256i m[16];
+        for (int t = 0; t < 16; t++) {
+            alignas(32) uint32 lanes[8];
+            for (int l = 0; l < 8; l++)
+                memcpy(&lanes[l], p[l] + 4 * t, 4);
+            m[t] = _mm256_load_si256((const __m256i *) lanes);
+        }
+
+        uint8 flags = job.flags;
+        if (b == 0)
+            flags |= job.flags_start;
+        if (b == block_nb - 1)
+            flags |= job.flags_end;
+
+        __m256i v[16];
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[8 + i] = _mm256_set1_epi32((int) blake3_iv[i]);
+        v[12] = _mm256_load_si256((const __m256i *) ctr_lo);
+        v[13] = _mm256_load_si256((const __m256i *) ctr_hi);
+        v[14] = _mm256_set1_epi32((int) (b == block_nb - 1 ? last_len : 64));
+        v[15] = _mm256_set1_epi32((int) flags);
+
+        for (int r = 0; r < 7; r++) {
+            const uint8 *o = blake3_schedule.order[r];
+            BLAKE3_V8_G(0, 4, 8, 12, m[o[0]], m[o[1]]);
+            BLAKE3_V8_G(1, 5, 9, 13, m[o[2]], m[o[3]]);
+            BLAKE3_V8_G(2, 6, 10, 14, m[o[4]], m[o[5]]);
+            BLAKE3_V8_G(3, 7, 11, 15, m[o[6]], m[o[7]]);
+            BLAKE3_V8_G(0, 5, 10, 15, m[o[8]], m[o[9]]);
+            BLAKE3_V8_G(1, 6, 11, 12, m[o[10]], m[o[11]]);
+            BLAKE3_V8_G(2, 7, 8, 13, m[o[12]], m[o[13]]);
+            BLAKE3_V8_G(3, 4, 9, 14, m[o[14]], m[o[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+
+    alignas(32) uint32 words[8][8];
+    for (int i = 0; i < 8; i++)
+        _mm256_store_si256((__m256i *) words[i], h[i]);
+    for (int l = 0; l < 8; l++) {
+        uint32 cv[8];
+        for (int i = 0; i < 8; i++)
+            cv[i] = words[i][l];
+        blake3_store_cv(cv, out + 32 * l);
+    }
+}
+
+// maskz form of the rotate, the unmasked intrinsic trips -Wmaybe-uninitialized in GCC's own header
+#define BLAKE3_V16_ROTR(x, n) _mm512_maskz_ror_epi32((__mmask16) 0xffff, x, n)
+
+#define BLAKE3_V16_G(a, b, c, d, x, y)                                                           \
+    {                                                                                            \
+        v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), x);                                \
+        v[d] = BLAKE3_V16_ROTR(_mm512_xor_si512(v[d], v[a]), 16);                               \
+        v[c] = _mm512_add_epi32(v[c], v[d]);                                                     \
+        v[b] = BLAKE3_V16_ROTR(_mm512_xor_si512(v[b], v[c]), 12);                               \
+        v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), y);                                \
+        v[d] = BLAKE3_V16_ROTR(_mm512_xor_si512(v[d], v[a]), 8);                                \
+        v[c] = _mm512_add_epi32(v[c], v[d]);                                                     \
+        v[b] = BLAKE3_V16_ROTR(_mm512_xor_si512(v[b], v[c]), 7);                                \
+    }
+
+// Sixteen inputs per call, same layout as the AVX2 kernel with native rotates.
+__attribute__((target("avx512f")))
+static void blake3_many_avx512(const blake3_lane_job &job, uint8 *out)
+{
+    unsigned int last_len;
+    unsigned int block_nb = blake3_block_count(job.len, &last_len);
+    uint8 tail[16][64];
+    for (int l = 0; l < 16; l++) {
+        memset(tail[l], 0, 64);
+        memcpy(tail[l], job.inputs[l] + 64 * (block_nb - 1), last_len);
+    }
+
+    alignas(64) uint32 ctr_lo[16], ctr_hi[16];
+    for (int l = 0; l < 16; l++) {
+        uint64 c = job.counter + (job.increment ? l : 0);
+        ctr_lo[l] = (uint32) c;
+        ctr_hi[l] = (uint32) (c >> 32);
+    }
+
+    __m512i h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm512_set1_epi32((int) job.key[i]);
+
+    for (unsigned int b = 0; b < block_nb; b++) {
+        const uint8 *p[16];
+        for (int l = 0; l < 16; l++)
+            p[l] = b == block_nb - 1 ? tail[l] : job.inputs[l] + 64 * b;
+        __m512i m[16];
+        for (int t = 0; t < 16; t++) {
+            alignas(64) uint32 lanes[16];
+            for (int l = 0; l < 16; l++)
+                memcpy(&lanes[l], p[l] + 4 * t, 4);
+            m[t] = _mm512_load_si512((const void *) lanes);
+        }
+
+        uint8 flags = job.flags;
+        if (b == 0)
+            flags |= job.flags_start;
+        if (b == block_nb - 1)
+            flags |= job.flags_end;
+
+        __m512i v[16];
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[8 + i] = _mm512_set1_epi32((int) blake3_iv[i]);
+        v[12] = _mm512_load_si512((const void *) ctr_lo);
+        v[13] = _mm512_load_si512((const void *) ctr_hi);
+        v[14] = _mm512_set1_epi32((int) (b == block_nb - 1 ? last_len : 64));
+        v[15] = _mm512_set1_epi32((int) flags);
+
+        for (int r = 0; r < 7; r++) {
+            const uint8 *o = blake3_schedule.order[r];
+            BLAKE3_V16_G(0, 4, 8, 12, m[o[0]], m[o[1]]);
+            BLAKE3_V16_G(1, 5, 9, 13, m[o[2]], m[o[3]]);
+            BLAKE3_V16_G(2, 6, 10, 14, m[o[4]], m[o[5]]);
+            BLAKE3_V16_G(3, 7, 11, 15, m[o[6]], m[o[7]]);
+            BLAKE3_V16_G(0, 5, 10, 15, m[o[8]], m[o[9]]);
+            BLAKE3_V16_G(1, 6, 11, 12, m[o[10]], m[o[11]]);
+            BLAKE3_V16_G(2, 7, 8, 13, m[o[12]], m[o[13]]);
+            BLAKE3_V16_G(3, 4, 9, 14, m[o[14]], m[o[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm512_xor_si512(v[i], v[i + 8]);
+    }
+
+    alignas(64) uint32 words[8][16];
+    for (int i = 0; i < 8; i++)
+        _mm512_store_si512((void *) words[i], h[i]);
+    for (int l = 0; l < 16; l++) {
+        uint32 cv[8];
+        for (int i = 0; i < 8; i++)
+            cv[i] = words[i][l];
+        blake3_store_cv(cv, out + 32 * l);
+    }
+}
+
+#endif
+
+typedef void (*blake3_many_fn)(const blake3_lane_job &, uint8 *);
+
+struct blake3_kernel {
+    blake3_compress_fn compress;
+    blake3_many_fn many;
+    unsigned int lanes;
+    const char *name;
+};
+
+// Picks the kernels from cpuid (and XGETBV for the ymm/zmm register state), see blake3_active_kernel().
+static blake3_kernel blake3_select_kernel()
+{
+    blake3_kernel kernel = {blake3_compress_portable, nullptr, 1, "portable"};
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    bool osxsave = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        osxsave = (ecx & bit_OSXSAVE) != 0;
+        if ((ecx & bit_SSE4_1) != 0)
+            kernel = {blake3_compress_sse41, nullptr, 1, "sse41"};
+    }
+    if (osxsave && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((ebx & bit_AVX512F) != 0 && (xcr0_lo & 0xe6) == 0xe6)
+            return {kernel.compress, blake3_many_avx512, 16, "avx512+sse41"};
+        if ((ebx & bit_AVX2) != 0 && (xcr0_lo & 0x6) == 0x6)
+            return {kernel.compress, blake3_many_avx2, 8, "avx2+sse41"};
+    }
+#endif
+    return kernel;
+}
+
+// Selected on first use, see sha256_active_kernel in sha256.cpp
+static const blake3_kernel &blake3_active_kernel()
+{
+    static const blake3_kernel kernel = blake3_select_kernel();
+    return kernel;
+}
+
+// Runs a job over count inputs, full vectors go through the SIMD kernel and the rest one at a time
+static void blake3_run_job(blake3_lane_job job, unsigned int count, uint8 *out)
+{
+    const blake3_kernel &kernel = blake3_active_kernel();
+    unsigned int i = 0;
+    if (kernel.many != nullptr) {
+        for (; i + kernel.lanes <= count; i += kernel.lanes) {
+            blake3_lane_job sub = job;
+            sub.inputs = job.inputs + i;
+            sub.counter = job.counter + (job.increment ? i : 0);
+            kernel.many(sub, out + 32 * i);
+        }
+    }
+    for (; i < count; i++)
+        blake3_hash_one(job, i, kernel.compress, out + 32 * i);
+}
+
+const char *BLAKE3::implementation()
+{
+    return blake3_active_kernel().name;
+}
+
+/*
+ * Incremental hasher
+ */
+
+void BLAKE3::init()
+{
+    memcpy(m_cv, blake3_iv, sizeof(m_cv));
+    m_block_len = 0;
+    m_blocks_compressed = 0;
+    m_chunk_counter = 0;
+    m_cv_stack_len = 0;
+}
+
+// Adds a completed chunk, merging finished subtrees: one merge for every trailing zero bit of the chunk count.
+void BLAKE3::push_chunk_cv(const uint32 cv[8], uint64 total_chunks)
+{
+    uint32 new_cv[8];
+    memcpy(new_cv, cv, sizeof(new_cv));
+    while ((total_chunks & 1) == 0) {
+        uint8 block[64];
+        blake3_store_cv(m_cv_stack[--m_cv_stack_len], block);
+        blake3_store_cv(new_cv, block + 32);
+        memcpy(new_cv, blake3_iv, sizeof(new_cv));
+        blake3_active_kernel().compress(new_cv, block, 64, 0, PARENT);
+        total_chunks >>= 1;
+    }
+    memcpy(m_cv_stack[m_cv_stack_len++], new_cv, sizeof(new_cv));
+}
+
+void BLAKE3::update(const unsigned char *message, size_t len)
+{
+    while (len > 0) {
+        unsigned int chunk_len = m_blocks_compressed * BLOCK_LEN + m_block_len;
+        // The current chunk is full and more input follows, so it is not the root: finish it.
+        if (chunk_len == CHUNK_LEN) {
+            blake3_active_kernel().compress(m_cv, m_block, BLOCK_LEN, m_chunk_counter,
+                                            (m_blocks_compressed == 0 ? CHUNK_START : 0) | CHUNK_END);
+            push_chunk_cv(m_cv, ++m_chunk_counter);
+            memcpy(m_cv, blake3_iv, sizeof(m_cv));
+            m_block_len = 0;
+            m_blocks_compressed = 0;
+            continue;
+        }
+        // Tree mode: a run of whole chunks (not the last one) is hashed one chunk per SIMD lane.
+        size_t lanes = blake3_active_kernel().lanes;
+        if (chunk_len == 0 && lanes > 1 && len > lanes * CHUNK_LEN) {
+            const uint8 *inputs[16];
+            uint8 cvs[16 * 32];
+            for (size_t l = 0; l < lanes; l++)
+                inputs[l] = message + l * CHUNK_LEN;
+            blake3_active_kernel().many({inputs, CHUNK_LEN, blake3_iv, m_chunk_counter, true, 0, CHUNK_START,
+                                         CHUNK_END}, cvs);
+            for (size_t l = 0; l < lanes; l++) {
+                uint32 cv[8];
+                for (int i = 0; i < 8; i++)
+                    cv[i] = blake3_load32(cvs + 32 * l + 4 * i);
+                push_chunk_cv(cv, ++m_chunk_counter);
+            }
+            message += lanes * CHUNK_LEN;
+            len -= lanes * CHUNK_LEN;
+            continue;
+        }
+        if (m_block_len == BLOCK_LEN) {
+            blake3_active_kernel().compress(m_cv, m_block, BLOCK_LEN, m_chunk_counter,
+                                            m_blocks_compressed == 0 ? CHUNK_START : 0);
+            m_blocks_compressed++;
+            m_block_len = 0;
+        }
+        size_t take = BLOCK_LEN - m_block_len;
+        if (take > len)
+            take = len;
+        memcpy(m_block + m_block_len, message, take);
+        m_block_len += take;
+        message += take;
+        len -= take;
+    }
+}
+
+void BLAKE3::final(unsigned char *digest)
+{
+    // The output of the current chunk, and then every parent on the stack, the last compression is the root.
+    uint32 cv[8];
+    uint8 block[64];
+    uint8 block_len = (uint8) m_block_len;
+    uint64 counter = m_chunk_counter;
+    uint8 flags = (m_blocks_compressed == 0 ? CHUNK_START : 0) | CHUNK_END;
+    memcpy(cv, m_cv, sizeof(cv));
+    memset(block, 0, sizeof(block));
+    memcpy(block, m_block, m_block_len);
+
+    for (unsigned int i = m_cv_stack_len; i > 0; i--) {
+        blake3_active_kernel().compress(cv, block, block_len, counter, flags);
+        blake3_store_cv(m_cv_stack[i - 1], block);
+        blake3_store_cv(cv, block + 32);
+        memcpy(cv, blake3_iv, sizeof(cv));
+        block_len = 64;
+        counter = 0;
+        flags = PARENT;
+    }
+    blake3_active_kernel().compress(cv, block, block_len, 0, flags | ROOT);
+    blake3_store_cv(cv, digest);
+}
+
+std::string blake3(std::string input)
+{
+    unsigned char digest[BLAKE3::DIGEST_SIZE];
+    BLAKE3 ctx = BLAKE3();
+    ctx.init();
+    ctx.update((unsigned char *) input.c_str(), input.length());
+    ctx.final(digest);
+
+    char buf[2 * BLAKE3::DIGEST_SIZE + 1];
+    buf[2 * BLAKE3::DIGEST_SIZE] = 0;
+    for (unsigned int i = 0; i < BLAKE3::DIGEST_SIZE; i++)
+        snprintf(buf + i * 2, 3, "%02x", digest[i]);
+    return std::string(buf);
+}
+
+/*
+ * Merkle helpers. A 64 byte input is a single chunk of a single block, so a whole interior node costs one
+ * compression.
+ */
+
+void blake3_hash_children(const unsigned char *left, const unsigned char *right, unsigned char *digest)
+{
+    uint32 cv[8];
+    uint8 block[64];
+    memcpy(cv, blake3_iv, sizeof(cv));
+    memcpy(block, left, 32);
+    memcpy(block + 32, right, 32);
+    blake3_active_kernel().compress(cv, block, 64, 0, CHUNK_START | CHUNK_END | ROOT);
+    blake3_store_cv(cv, digest);
+}
+
+void blake3_hash_child(const unsigned char *child, unsigned char *digest)
+{
+    uint32 cv[8];
+    uint8 block[64] = {0};
+    memcpy(cv, blake3_iv, sizeof(cv));
+    memcpy(block, child, 32);
+    blake3_active_kernel().compress(cv, block, 32, 0, CHUNK_START | CHUNK_END | ROOT);
+    blake3_store_cv(cv, digest);
+}
+
+void blake3_many(const unsigned char *const *messages, unsigned int len, unsigned int count, unsigned char *digests)
+{
+    if (len > BLAKE3::CHUNK_LEN) {
+        // multi-chunk messages go through the tree mode hasher one at a time
+        for (unsigned int i = 0; i < count; i++) {
+            BLAKE3 ctx;
+            ctx.init();
+            ctx.update(messages[i], len);
+            ctx.final(digests + i * BLAKE3::DIGEST_SIZE);
+        }
+        return;
+    }
+    blake3_run_job({messages, len, blake3_iv, 0, false, 0, CHUNK_START, CHUNK_END | ROOT}, count, digests);
+}
+
+unsigned int blake3_many_lanes()
+{
+    return blake3_active_kernel().lanes;
+}
@@ -0,0 +1,60 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+#include <cstddef>
+#include <string>
+
+/**
+ * BLAKE3 (https://github.com/BLAKE3-team/BLAKE3-specs), default hashing mode with 32 byte output.
+ *
+ * Follows the SHA256 class interface: init(), update() and final(). Inputs longer than one chunk are hashed in
+ * BLAKE3's tree mode, and runs of whole chunks are compressed several at a time by the widest SIMD kernel the CPU
+ * supports (AVX-512, AVX2), single compressions use SSE4.1 when available.
+ */
+class BLAKE3
+{
+protected:
+    typedef unsigned char uint8;
+    typedef unsigned int uint32;
+    typedef unsigned long long uint64;
+
+    // enough for 2^54 chunks, the most a 64-bit input length can produce
+    static const unsigned int MAX_DEPTH = 54;
+public:
+    void init();
+    void update(const unsigned char *message, size_t len);
+    void final(unsigned char *digest);
+    static const unsigned int DIGEST_SIZE = 32;
+    static const unsigned int BLOCK_LEN = 64;
+    static const unsigned int CHUNK_LEN = 1024;
+    // Name of the kernels selected for this CPU, e.g. "avx512+sse41"
+    static const char *implementation();
+
+protected:
+    void push_chunk_cv(const uint32 cv[8], uint64 total_chunks);
+    // state of the chunk currently being filled
+    uint32 m_cv[8];
+    uint8 m_block[BLOCK_LEN];
+    unsigned int m_block_len;
+    unsigned int m_blocks_compressed;
+    uint64 m_chunk_counter;
+    // chaining values of completed subtrees, merged as chunks complete
+    uint32 m_cv_stack[MAX_DEPTH][8];
+    unsigned int m_cv_stack_len;
+};
+
+std::string blake3(std::string input);
+
+// Merkle interior node helpers: blake3(left || right) and blake3(child) for 32 byte binary digests.
+void blake3_hash_children(const unsigned char *left, const unsigned char *right, unsigned char *digest);
+void blake3_hash_child(const unsigned char *child, unsigned char *digest);
+
+/**
+ * Hashes count independent messages that are all len bytes long, writing count * DIGEST_SIZE bytes of binary
+ * digests. Each message is placed in its own SIMD lane.
+ */
+void blake3_many(const unsigned char *const *messages, unsigned int len, unsigned int count, unsigned char *digests);
+
+// Number of messages (or chunks) the selected multi-buffer kernel processes per call
+unsigned int blake3_many_lanes();
+
+#endif
@@ -6,16 +6,22 @@
 //  Copyright © 2020 n00b. All rights reserved.
 //
 
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <time.h>
+#include <unistd.h>
+#include "HashPolicy.h"
 #include "MerkleTree.h"
+#include "Reclaimer.h"
 #include "md5.h"
 #include "sha256.h"
 #include "SequentialMerkle.h"
 
-void parallel_work(int thread_id, int num_ops, Concurrent::MerkleTree<int*> *tree)
+template<typename HashPolicy>
+void parallel_work(int thread_id, int num_ops, Concurrent::MerkleTree<int*, HashPolicy> *tree)
 {
     int numInserts = num_ops * .2;
     int numContains = num_ops - numInserts;
@@ -31,15 +37,16 @@ void parallel_work(int thread_id, int num_ops, Concurrent::MerkleTree<int*> *tre
     }
 }
 
+template<typename HashPolicy>
 double parallel_benchmark(int NUM_OP, int NUM_THREADS) {
-    auto* tree = new Concurrent::MerkleTree<int*>(sha256);
+    auto* tree = new Concurrent::MerkleTree<int*, HashPolicy>();
     std::vector<std::thread> threads;
     std::cout << "Concurrent Benchmark" << std::endl;
     std::cout << "\tInitializing Threads" << std::endl;
     auto start = std::chrono::high_resolution_clock::now();
 
     for (int i = 0; i < NUM_THREADS; i++) {
-        threads.push_back(std::thread(parallel_work, i, NUM_OP, tree));
+        threads.push_back(std::thread(parallel_work<HashPolicy>, i, NUM_OP, tree));
     }
     
     for (std::thread &t : threads)
@@ -86,7 +93,8 @@ double parallel_benchmark(int NUM_OP, int NUM_THREADS) {
     return throughput;
 }
 
-void sequential_work(int thread_id, int num_ops, Sequential::MerkleTree<int*> *tree)
+template<typename HashPolicy>
+void sequential_work(int thread_id, int num_ops, Sequential::MerkleTree<int*, HashPolicy> *tree)
 {
     int numInserts = num_ops * .2;
     int numContains = num_ops - numInserts;
@@ -102,8 +110,9 @@ void sequential_work(int thread_id, int num_ops, Sequential::MerkleTree<int*> *t
     }
 }
 
+template<typename HashPolicy>
 double sequential_benchmark(int NUM_OP, int NUM_THREADS) {
-    auto* tree = new Sequential::MerkleTree<int*>(sha256);
+    auto* tree = new Sequential::MerkleTree<int*, HashPolicy>();
     
     std::vector<std::thread> threads;
     std::cout << std::endl << "Coarse Grained Benchmark" << std::endl;
@@ -112,7 +121,7 @@ double sequential_benchmark(int NUM_OP, int NUM_THREADS) {
     auto start = std::chrono::high_resolution_clock::now();
 
     for (int i = 0; i < NUM_THREADS; i++) {
-        threads.push_back(std::thread(sequential_work, i, NUM_OP, tree));
+        threads.push_back(std::thread(sequential_work<HashPolicy>, i, NUM_OP, tree));
     }
     for (std::thread &t : threads)
         t.join();
@@ -153,25 +162,399 @@ double sequential_benchmark(int NUM_OP, int NUM_THREADS) {
     return throughput;
 }
 
-int main(int argc, const char * argv[]) {
-    int NUM_OP = 100000;
-    int NUM_THREADS = 4;
+// Resident set size in MB, read from /proc/self/statm. Returns -1 where that is not available.
+double resident_mb() {
+    std::ifstream statm("/proc/self/statm");
+    long pages, resident;
+    if(!(statm >> pages >> resident))
+        return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0));
+}
+
+template<typename Tree>
+void insert_work(int thread_id, int num_ops, Tree *tree)
+{
+    int base = thread_id * num_ops;
+    for (int i = 0; i < num_ops; i++) {
+        int* nextItem = new int(base + i);
+        tree->insert(nextItem);
+    }
+}
+
+/**
+ * Builds and destroys a tree ROUNDS times, printing throughput and resident memory after every round. Memory that
+ * a reclaimer never frees shows up as RSS growing from round to round.
+ */
+template<typename HashPolicy, typename Reclaimer>
+double reclamation_benchmark(const char* name, int NUM_OP, int NUM_THREADS) {
+    const int ROUNDS = 5;
+    double total = 0;
+    std::cout << name << std::endl;
+    std::cout << "\tRound\tThroughput (ops/sec)\tRSS (MB)" << std::endl;
+    for (int round = 0; round < ROUNDS; round++) {
+        auto* tree = new Concurrent::MerkleTree<int*, HashPolicy, KeyMode::STD_HASH, Reclaimer>();
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < NUM_THREADS; i++) {
+            threads.push_back(std::thread(insert_work<Concurrent::MerkleTree<int*, HashPolicy, KeyMode::STD_HASH, Reclaimer>>, i, NUM_OP, tree));
+        }
+        for (std::thread &t : threads)
+            t.join();
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        auto throughput = (NUM_OP * NUM_THREADS) / seconds.count();
+        total += throughput;
+        delete tree;
+        std::cout << "\t" << round << "\t" << throughput << "\t\t\t" << resident_mb() << std::endl;
+    }
+    return total / ROUNDS;
+}
+
+template<typename HashPolicy>
+void reclamation_benchmarks(int NUM_OP, int NUM_THREADS) {
+    std::cout << "Reclamation Benchmark (inserts only, tree rebuilt every round)" << std::endl;
+    auto epoch = reclamation_benchmark<HashPolicy, EpochReclaimer>("Epoch based", NUM_OP, NUM_THREADS);
+    auto hazard = reclamation_benchmark<HashPolicy, HazardReclaimer>("Hazard pointers", NUM_OP, NUM_THREADS);
+    auto leaking = reclamation_benchmark<HashPolicy, LeakingReclaimer>("Leaking (no reclamation)", NUM_OP, NUM_THREADS);
+    std::cout << std::endl << "Reclamation Cost" << std::endl;
+    std::cout << "\tEpoch based\t: " << ((epoch - leaking) / leaking * 100) << "% throughput vs leaking" << std::endl;
+    std::cout << "\tHazard pointers\t: " << ((hazard - leaking) / leaking * 100) << "% throughput vs leaking" << std::endl;
+}
+
+/**
+ * Inserts the same values through insert() on NUM_THREADS threads, as a single insert_bulk() batch and with build().
+ * The roots have to match. The batches hold every fourth value twice, the tree takes one of each and the copies it
+ * leaves in the batch are freed here, so a leak or a double free shows up under a sanitizer.
+ */
+template<typename HashPolicy>
+void bulk_benchmark(int NUM_OP, int NUM_THREADS) {
+    typedef Concurrent::MerkleTree<int*, HashPolicy> Tree;
+    std::cout << "Bulk Insert / Build Benchmark" << std::endl;
     
-    if(argc == 3) {
-        NUM_OP = atoi(argv[1]);
-        NUM_THREADS = atoi(argv[2]);
-    } else {
-        std::cout << "Using Default Enviornment." << std::endl;
-        std::cout << "To define user parameters use .\\<program> <num ops> <thread count>" << std::endl << std::endl;
+    auto* single = new Tree();
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < NUM_THREADS; i++) {
+        threads.push_back(std::thread(insert_work<Tree>, i, NUM_OP, single));
     }
+    for (std::thread &t : threads)
+        t.join();
+    std::string singleRoot = single->getRootValue();
+    std::chrono::duration<double> singleSeconds = std::chrono::high_resolution_clock::now() - start;
+    delete single;
     
-    std::cout << "Starting Benchmarks" << std::endl;
-    std::cout << "\tThread Count\t: " << NUM_THREADS << std::endl;
-    std::cout << "\tOps per Thread  : " << NUM_OP << std::endl << std::endl;
+    std::vector<int*> batch;
+    auto fill = [&batch, NUM_OP, NUM_THREADS]() {
+        batch.clear();
+        for (int i = 0; i < NUM_OP * NUM_THREADS; i++) {
+            batch.push_back(new int(i));
+            if(i % 4 == 0)
+                batch.push_back(new int(i));
+        }
+    };
+    // the values the tree took are nullptr in the batch, the duplicates are still there
+    auto leftovers = [&batch]() {
+        std::size_t left = 0;
+        for (int* value : batch) {
+            if(value != nullptr)
+                left++;
+            delete value;
+        }
+        return left;
+    };
+    
+    fill();
+    auto* bulk = new Tree();
+    start = std::chrono::high_resolution_clock::now();
+    std::size_t bulkTaken = bulk->insert_bulk(batch, NUM_THREADS);
+    std::string bulkRoot = bulk->getRootValue();
+    std::chrono::duration<double> bulkSeconds = std::chrono::high_resolution_clock::now() - start;
+    delete bulk;
+    bool taken = bulkTaken == (std::size_t) NUM_OP * NUM_THREADS && bulkTaken + leftovers() == batch.size();
+    
+    fill();
+    start = std::chrono::high_resolution_clock::now();
+    auto* built = Tree::build(batch, NUM_THREADS);
+    std::string builtRoot = built->getRootValue();
+    std::chrono::duration<double> buildSeconds = std::chrono::high_resolution_clock::now() - start;
+    delete built;
+    taken = taken && leftovers() == batch.size() - (std::size_t) NUM_OP * NUM_THREADS;
+    
+    std::cout << "\tinsert()\t: " << (NUM_OP * NUM_THREADS) / singleSeconds.count() << " ops/sec" << std::endl;
+    std::cout << "\tinsert_bulk()\t: " << (NUM_OP * NUM_THREADS) / bulkSeconds.count() << " ops/sec" << std::endl;
+    std::cout << "\tbuild()\t\t: " << (NUM_OP * NUM_THREADS) / buildSeconds.count() << " ops/sec" << std::endl;
+    std::cout << "\tRoots\t\t: " << (singleRoot == bulkRoot && singleRoot == builtRoot ? "Equal" : "DIFFERENT") << std::endl;
+    std::cout << "\tOwnership\t: " << (taken ? "Correct" : "INCORRECT") << std::endl;
+}
+
+/**
+ * Inserts the same values on NUM_THREADS threads into trees with 0, 4 and 8 permanent top levels (1, 16 and 256
+ * shards). The roots have to match.
+ */
+template<typename HashPolicy>
+void shard_benchmark(int NUM_OP, int NUM_THREADS) {
+    typedef Concurrent::MerkleTree<int*, HashPolicy> Tree;
+    std::cout << "Sharded Root Benchmark" << std::endl;
+    std::cout << "\tShard Bits\tThroughput (ops/sec)" << std::endl;
+    std::string roots[3];
+    const unsigned int SHARD_BITS[3] = {0, 4, 8};
+    for (int i = 0; i < 3; i++) {
+        auto* tree = new Tree(HashPolicy(), SHARD_BITS[i]);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < NUM_THREADS; t++) {
+            threads.push_back(std::thread(insert_work<Tree>, t, NUM_OP, tree));
+        }
+        for (std::thread &t : threads)
+            t.join();
+        roots[i] = tree->getRootValue();
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        delete tree;
+        std::cout << "\t" << SHARD_BITS[i] << "\t\t" << (NUM_OP * NUM_THREADS) / seconds.count() << std::endl;
+    }
+    std::cout << "\tRoots\t\t: " << (roots[0] == roots[1] && roots[0] == roots[2] ? "Equal" : "DIFFERENT") << std::endl;
+}
 
+template<typename Tree>
+void contains_work(int thread_id, int num_ops, Tree *tree)
+{
+    int base = thread_id * num_ops;
+    for (int i = 0; i < num_ops; i++) {
+        int item = base + i;
+        tree->contains(&item);
+    }
+}
+
+/**
+ * Inserts and then looks up NUM_OP values per thread in a tree with the given fanout. The root differs between
+ * fanouts, so each tree is checked with validate() instead.
+ */
+template<typename HashPolicy, unsigned int Radix>
+void radix_round(int NUM_OP, int NUM_THREADS) {
+    typedef Concurrent::MerkleTree<int*, HashPolicy, KeyMode::STD_HASH, EpochReclaimer, Radix> Tree;
+    auto* tree = new Tree();
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < NUM_THREADS; t++) {
+        threads.push_back(std::thread(insert_work<Tree>, t, NUM_OP, tree));
+    }
+    for (std::thread &t : threads)
+        t.join();
+    std::chrono::duration<double> insertSeconds = std::chrono::high_resolution_clock::now() - start;
     
-    auto concurrent_throughput = parallel_benchmark(NUM_OP, NUM_THREADS);
-    auto sequential_throughput = sequential_benchmark(NUM_OP, NUM_THREADS);
+    threads.clear();
+    start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < NUM_THREADS; t++) {
+        threads.push_back(std::thread(contains_work<Tree>, t, NUM_OP, tree));
+    }
+    for (std::thread &t : threads)
+        t.join();
+    std::chrono::duration<double> containsSeconds = std::chrono::high_resolution_clock::now() - start;
+    bool valid = tree->validate();
+    delete tree;
+    std::cout << "\t" << Radix << "\t" << (NUM_OP * NUM_THREADS) / insertSeconds.count() << "\t\t"
+              << (NUM_OP * NUM_THREADS) / containsSeconds.count() << "\t\t" << (valid ? "Valid" : "INVALID") << std::endl;
+}
+
+template<typename HashPolicy>
+void radix_benchmark(int NUM_OP, int NUM_THREADS) {
+    std::cout << "Node Fanout Benchmark" << std::endl;
+    std::cout << "\tRadix\tInsert (ops/sec)\tContains (ops/sec)\tTree" << std::endl;
+    radix_round<HashPolicy, 2>(NUM_OP, NUM_THREADS);
+    radix_round<HashPolicy, 16>(NUM_OP, NUM_THREADS);
+    radix_round<HashPolicy, 256>(NUM_OP, NUM_THREADS);
+}
+
+template<typename Tree>
+void value_insert_work(int thread_id, int num_ops, Tree *tree)
+{
+    int base = thread_id * num_ops;
+    for (int i = 0; i < num_ops; i++)
+        tree->insert(base + i);
+}
+
+template<typename Tree>
+void value_contains_work(int thread_id, int num_ops, Tree *tree)
+{
+    int base = thread_id * num_ops;
+    for (int i = 0; i < num_ops; i++)
+        tree->contains(base + i);
+}
+
+// Runs the insert and then the contains workers on NUM_THREADS threads and returns the root, the throughputs go to
+// inserts and lookups.
+template<typename Tree, typename InsertWork, typename ContainsWork>
+std::string storage_round(int NUM_OP, int NUM_THREADS, InsertWork insertWork, ContainsWork containsWork,
+                          double& inserts, double& lookups) {
+    auto* tree = new Tree();
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < NUM_THREADS; t++) {
+        threads.push_back(std::thread(insertWork, t, NUM_OP, tree));
+    }
+    for (std::thread &t : threads)
+        t.join();
+    std::chrono::duration<double> insertSeconds = std::chrono::high_resolution_clock::now() - start;
+    
+    threads.clear();
+    start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < NUM_THREADS; t++) {
+        threads.push_back(std::thread(containsWork, t, NUM_OP, tree));
+    }
+    for (std::thread &t : threads)
+        t.join();
+    std::chrono::duration<double> containsSeconds = std::chrono::high_resolution_clock::now() - start;
+    std::string root = tree->getRootValue();
+    delete tree;
+    inserts = (NUM_OP * NUM_THREADS) / insertSeconds.count();
+    lookups = (NUM_OP * NUM_THREADS) / containsSeconds.count();
+    return root;
+}
+
+/**
+ * Inserts and looks up the same ints stored as int* (a new int per insert, owned by the tree) and stored by value in
+ * the leaves. Both hash the int itself, so the roots have to match.
+ */
+template<typename HashPolicy>
+void storage_benchmark(int NUM_OP, int NUM_THREADS) {
+    typedef Concurrent::MerkleTree<int*, HashPolicy> PointerTree;
+    typedef Concurrent::MerkleTree<int, HashPolicy> ValueTree;
+    std::cout << "Leaf Storage Benchmark" << std::endl;
+    std::cout << "\tStorage\tInsert (ops/sec)\tContains (ops/sec)" << std::endl;
+    double inserts, lookups;
+    std::string pointerRoot = storage_round<PointerTree>(NUM_OP, NUM_THREADS, insert_work<PointerTree>,
+                                                         contains_work<PointerTree>, inserts, lookups);
+    std::cout << "\tint*\t" << inserts << "\t\t" << lookups << std::endl;
+    std::string valueRoot = storage_round<ValueTree>(NUM_OP, NUM_THREADS, value_insert_work<ValueTree>,
+                                                     value_contains_work<ValueTree>, inserts, lookups);
+    std::cout << "\tint\t" << inserts << "\t\t" << lookups << std::endl;
+    std::cout << "\tRoots\t: " << (pointerRoot == valueRoot ? "Equal" : "DIFFERENT") << std::endl;
+}
+
+/**
+ * Looks up NUM_OP values per thread in a tree of NUM_OP * NUM_THREADS values, one contains() at a time and with
+ * contains_many() in batches of BATCH. Every other value looked up is missing. The answers have to match.
+ */
+template<typename HashPolicy>
+void lookup_benchmark(int NUM_OP, int NUM_THREADS) {
+    typedef Concurrent::MerkleTree<int, HashPolicy> Tree;
+    static const int BATCH = 4096;
+    std::cout << "Batched Lookup Benchmark" << std::endl;
+    
+    std::vector<int> values;
+    for (int i = 0; i < NUM_OP * NUM_THREADS; i++)
+        values.push_back(2 * i);
+    auto* tree = Tree::build(values, NUM_THREADS);
+    
+    std::vector<std::vector<bool>> single(NUM_THREADS), batched(NUM_THREADS);
+    auto lookups = [tree, NUM_OP](int thread_id, std::vector<bool>* found, bool many) {
+        std::vector<int> keys(NUM_OP);
+        for (int i = 0; i < NUM_OP; i++)
+            keys[i] = thread_id * NUM_OP + i;
+        if (!many) {
+            for (int key : keys)
+                found->push_back(tree->contains(key));
+            return;
+        }
+        std::vector<bool> batch;
+        for (int i = 0; i < NUM_OP; i += BATCH) {
+            tree->contains_many(std::span<const int>(keys).subspan(i, std::min(BATCH, NUM_OP - i)), batch);
+            found->insert(found->end(), batch.begin(), batch.end());
+        }
+    };
+    
+    double seconds[2];
+    for (int many = 0; many < 2; many++) {
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < NUM_THREADS; t++) {
+            threads.push_back(std::thread(lookups, t, many ? &batched[t] : &single[t], many == 1));
+        }
+        for (std::thread &t : threads)
+            t.join();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        seconds[many] = elapsed.count();
+    }
+    delete tree;
+    
+    std::cout << "\tcontains()\t: " << (NUM_OP * NUM_THREADS) / seconds[0] << " ops/sec" << std::endl;
+    std::cout << "\tcontains_many()\t: " << (NUM_OP * NUM_THREADS) / seconds[1] << " ops/sec" << std::endl;
+    std::cout << "\tAnswers\t\t: " << (single == batched ? "Equal" : "DIFFERENT") << std::endl;
+}
+
+/**
+ * Proves NUM_OP values per thread of a tree of NUM_OP * NUM_THREADS values while another thread keeps inserting and
+ * removing one more value, with 0, 8 and 16 shard bits, eager and lazy. The tree only ever has two roots, the one with
+ * and the one without that value, read through getRootValue() before the provers start. Every proof has to verify
+ * against one of them. A proof walks one route whatever the number of shards, so the throughput with 2^16 shards has
+ * to stay within a factor of 4 of the one without.
+ */
+template<typename HashPolicy>
+void proof_benchmark(int NUM_OP, int NUM_THREADS) {
+    typedef Concurrent::MerkleTree<int, HashPolicy> Tree;
+    std::cout << "Membership Proof Benchmark" << std::endl;
+    std::cout << "\tShard Bits\tLazy\tThroughput (ops/sec)" << std::endl;
+    
+    std::vector<int> values;
+    for (int i = 0; i < NUM_OP * NUM_THREADS; i++)
+        values.push_back(2 * i);
+    const unsigned int SHARD_BITS[3] = {0, 8, 16};
+    static const int EXTRA = -1;
+    bool valid = true;
+    double throughput[6];
+    for (int i = 0; i < 6; i++) {
+        auto* tree = Tree::build(values, NUM_THREADS, HashPolicy(), SHARD_BITS[i / 2]);
+        if (i % 2 == 1)
+            tree->setLazy(true, NUM_THREADS);
+        std::string roots[2];
+        roots[0] = tree->getRootValue();
+        tree->insert(EXTRA);
+        roots[1] = tree->getRootValue();
+        tree->remove(EXTRA);
+        
+        std::atomic<bool> done{false};
+        std::atomic<int> verified{0};
+        std::thread writer([tree, &done]() {
+            while (!done.load()) {
+                tree->insert(EXTRA);
+                tree->remove(EXTRA);
+            }
+        });
+        auto proofs = [tree, NUM_OP, &roots, &verified](int thread_id) {
+            int count = 0;
+            for (int i = thread_id * NUM_OP; i < (thread_id + 1) * NUM_OP; i++) {
+                auto proof = tree->prove(2 * i);
+                if (proof && (Tree::verify(2 * i, *proof, roots[0]) || Tree::verify(2 * i, *proof, roots[1])))
+                    count++;
+            }
+            verified += count;
+        };
+        
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < NUM_THREADS; t++) {
+            threads.push_back(std::thread(proofs, t));
+        }
+        for (std::thread &t : threads)
+            t.join();
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        done = true;
+        writer.join();
+        delete tree;
+        
+        valid = valid && verified == NUM_OP * NUM_THREADS;
+        throughput[i] = (NUM_OP * NUM_THREADS) / seconds.count();
+        std::cout << "\t" << SHARD_BITS[i / 2] << "\t\t" << (i % 2 == 1 ? "yes" : "no") << "\t"
+                  << throughput[i] << std::endl;
+    }
+    bool flat = throughput[4] * 4 >= throughput[0] && throughput[5] * 4 >= throughput[1];
+    std::cout << "\tProofs\t\t: " << (valid ? "Valid" : "INVALID") << std::endl;
+    std::cout << "\tCost\t\t: " << (flat ? "Independent of shards" : "GROWS WITH SHARDS") << std::endl;
+}
+
+template<typename HashPolicy>
+void compare_benchmark(int NUM_OP, int NUM_THREADS) {
+    double concurrent_throughput = parallel_benchmark<HashPolicy>(NUM_OP, NUM_THREADS);
+    double sequential_throughput = sequential_benchmark<HashPolicy>(NUM_OP, NUM_THREADS);
     
     std::cout << std::endl << "Concurrent vs Coarse Grained Throughput" << std::endl;
     std::cout << "\t<timesdiff = parallel / coarse>" << std::endl;
@@ -192,5 +575,88 @@ int main(int argc, const char * argv[]) {
         std::cout << std::endl << "¯\\_(ツ)_/¯\t¯\\_(ツ)_/¯\t¯\\_(ツ)_/¯\t¯\\_(ツ)_/¯\t¯\\_(ツ)_/¯" << std::endl;
     }
     std::cout << std::endl << "Benchmark Completed" << std::endl << "\t";
+}
+
+// Adapters so each benchmark can be handed to run() as a template template argument.
+template<typename HashPolicy> struct CompareMode { static void run(int n, int t) { compare_benchmark<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct MemoryMode { static void run(int n, int t) { reclamation_benchmarks<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct BulkMode { static void run(int n, int t) { bulk_benchmark<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct ShardsMode { static void run(int n, int t) { shard_benchmark<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct RadixMode { static void run(int n, int t) { radix_benchmark<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct StorageMode { static void run(int n, int t) { storage_benchmark<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct LookupMode { static void run(int n, int t) { lookup_benchmark<HashPolicy>(n, t); } };
+template<typename HashPolicy> struct ProofMode { static void run(int n, int t) { proof_benchmark<HashPolicy>(n, t); } };
+
+// Instantiates Bench with the hash policy named by HASH, which main() has already validated.
+template<template<class> class Bench>
+void run(const char* HASH, int NUM_OP, int NUM_THREADS) {
+    if(strcmp(HASH, "blake3") == 0)
+        Bench<Blake3Policy>::run(NUM_OP, NUM_THREADS);
+    else if(strcmp(HASH, "md5") == 0)
+        Bench<Md5Policy>::run(NUM_OP, NUM_THREADS);
+    else
+        Bench<Sha256Policy>::run(NUM_OP, NUM_THREADS);
+}
+
+struct Mode {
+    const char* name;
+    void (*run)(const char* HASH, int NUM_OP, int NUM_THREADS);
+};
+
+// The first entry is the default when no mode is given.
+static const Mode MODES[] = {
+    { "compare", run<CompareMode> },
+    { "memory", run<MemoryMode> },
+    { "bulk", run<BulkMode> },
+    { "shards", run<ShardsMode> },
+    { "radix", run<RadixMode> },
+    { "storage", run<StorageMode> },
+    { "lookup", run<LookupMode> },
+    { "proof", run<ProofMode> },
+};
+
+int main(int argc, const char * argv[]) {
+    int NUM_OP = 100000;
+    int NUM_THREADS = 4;
+    
+    const char* HASH = "sha256";
+    const Mode* mode = &MODES[0];
+    
+    if(argc >= 3 && argc <= 5) {
+        NUM_OP = atoi(argv[1]);
+        NUM_THREADS = atoi(argv[2]);
+        if(argc >= 4)
+            HASH = argv[3];
+        if(argc == 5) {
+            mode = nullptr;
+            for(const Mode& m : MODES)
+                if(strcmp(argv[4], m.name) == 0)
+                    mode = &m;
+            if(mode == nullptr) {
+                std::cout << "Unknown benchmark mode " << argv[4] << ", expected compare, memory, bulk, shards, radix, storage, lookup or proof" << std::endl;
+                return 1;
+            }
+        }
+    } else {
+        std::cout << "Using Default Enviornment." << std::endl;
+        std::cout << "To define user parameters use .\\<program> <num ops> <thread count> [sha256|blake3|md5] [compare|memory|bulk|shards|radix|storage|lookup|proof]" << std::endl << std::endl;
+    }
+    if(strcmp(HASH, "sha256") != 0 && strcmp(HASH, "blake3") != 0 && strcmp(HASH, "md5") != 0) {
+        std::cout << "Unknown hash function " << HASH << ", expected sha256, blake3 or md5" << std::endl;
+        return 1;
+    }
+    
+    std::cout << "Starting Benchmarks" << std::endl;
+    std::cout << "\tThread Count\t: " << NUM_THREADS << std::endl;
+    std::cout << "\tOps per Thread  : " << NUM_OP << std::endl;
+    std::cout << "\tHash Function   : " << HASH << std::endl;
+    if(strcmp(HASH, "sha256") == 0)
+        std::cout << "\tSHA-256 Kernel  : " << SHA256::implementation() << std::endl << std::endl;
+    else if(strcmp(HASH, "blake3") == 0)
+        std::cout << "\tBLAKE3 Kernel   : " << BLAKE3::implementation() << std::endl << std::endl;
+    else
+        std::cout << std::endl;
+
+    mode->run(HASH, NUM_OP, NUM_THREADS);
     return 0;
 }
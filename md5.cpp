@@ -347,6 +347,17 @@ std::string MD5::hexdigest() const
 
 //////////////////////////////
 
+// return the binary digest, avoids the hex round trip for callers that store raw digests
+const unsigned char* MD5::rawdigest() const
+{
+    if (!finalized)
+        return nullptr;
+
+    return digest;
+}
+
+//////////////////////////////
+
 std::ostream& operator<<(std::ostream& out, MD5 md5)
 {
     return out << md5.hexdigest();
@@ -66,6 +66,7 @@ public:
     void update(const char *buf, size_type length);
     MD5& finalize();
     std::string hexdigest() const;
+    const unsigned char* rawdigest() const; // the 16 digest bytes, nullptr until finalized
     friend std::ostream& operator<<(std::ostream&, MD5 md5);
 
 private:
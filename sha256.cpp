@@ -1,6 +1,11 @@
 #include <cstring>
 #include <fstream>
 #include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
  
 const unsigned int SHA256::sha256_k[64] = //UL = uint32
             {0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
@@ -19,9 +24,22 @@ const unsigned int SHA256::sha256_k[64] = //UL = uint32
              0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
              0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
              0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// Initial hash value, also used to seed every lane of the multi-buffer kernels
+static const unsigned int sha256_h0[8] =
+            {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+const unsigned int *SHA256::k()
+{
+    return sha256_k;
+}
  
-void SHA256::transform(const unsigned char *message, unsigned int block_nb)
+// Portable reference compression function, used when the CPU has no SHA or SSSE3 support.
+static void sha256_transform_scalar(unsigned int *m_h, const unsigned char *message, unsigned int block_nb)
 {
+    typedef unsigned int uint32;
+    const uint32 *sha256_k = SHA256::k();
     uint32 w[64];
     uint32 wv[8];
     uint32 t1, t2;
@@ -57,17 +75,299 @@ void SHA256::transform(const unsigned char *message, unsigned int block_nb)
         }
     }
 }
+
+// One round with the working variables renamed instead of shifted, w already has the round constant added
+#define SHA2_ROUND(a, b, c, d, e, f, g, h, wk)                        \
+{                                                                     \
+    uint32 t1 = h + SHA256_F2(e) + SHA2_CH(e, f, g) + (wk);           \
+    d += t1;                                                          \
+    h = t1 + SHA256_F1(a) + SHA2_MAJ(a, b, c);                        \
+}
+
+// Rounds only, for blocks whose schedule (plus round constants) wk was computed ahead of time.
+static void sha256_rounds_scalar(unsigned int *m_h, const unsigned int *wk)
+{
+    typedef unsigned int uint32;
+    uint32 a = m_h[0], b = m_h[1], c = m_h[2], d = m_h[3];
+    uint32 e = m_h[4], f = m_h[5], g = m_h[6], h = m_h[7];
+    for (int j = 0; j < 64; j += 8) {
+        SHA2_ROUND(a, b, c, d, e, f, g, h, wk[j + 0]);
+        SHA2_ROUND(h, a, b, c, d, e, f, g, wk[j + 1]);
+        SHA2_ROUND(g, h, a, b, c, d, e, f, wk[j + 2]);
+        SHA2_ROUND(f, g, h, a, b, c, d, e, wk[j + 3]);
+        SHA2_ROUND(e, f, g, h, a, b, c, d, wk[j + 4]);
+        SHA2_ROUND(d, e, f, g, h, a, b, c, wk[j + 5]);
+        SHA2_ROUND(c, d, e, f, g, h, a, b, wk[j + 6]);
+        SHA2_ROUND(b, c, d, e, f, g, h, a, wk[j + 7]);
+    }
+    m_h[0] += a; m_h[1] += b; m_h[2] += c; m_h[3] += d;
+    m_h[4] += e; m_h[5] += f; m_h[6] += g; m_h[7] += h;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Rotate right of each 32-bit lane
+#define SHA2_VROTR(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+
+/**
+ * SSSE3 kernel. The message schedule is computed four words at a time and the round constants are folded into it,
+ * sigma1 for the upper two lanes depends on the lower two lanes of the same vector, so each group of four is
+ * produced in two halves. The rounds are unrolled by eight so the working variables stay in registers.
+ */
+__attribute__((target("ssse3")))
+static void sha256_transform_ssse3(unsigned int *m_h, const unsigned char *message, unsigned int block_nb)
+{
+    typedef unsigned int uint32;
+    const uint32 *sha256_k = SHA256::k();
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    alignas(16) uint32 wk[64];
+    int j;
+    for (unsigned int i = 0; i < block_nb; i++) {
+        const unsigned char *sub_block = message + (i << 6);
+        __m128i x[4];
+        for (j = 0; j < 4; j++) {
+            x[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (sub_block + 16 * j)), bswap);
+            _mm_store_si128((__m128i *) &wk[4 * j],
+                            _mm_add_epi32(x[j], _mm_loadu_si128((const __m128i *) &sha256_k[4 * j])));
+        }
+        for (j = 16; j < 64; j += 4) {
+            // w[j-15 .. j-12] and w[j-7 .. j-4]
+            __m128i w15 = _mm_alignr_epi8(x[1], x[0], 4);
+            __m128i w7 = _mm_alignr_epi8(x[3], x[2], 4);
+            __m128i s0 = _mm_xor_si128(_mm_xor_si128(SHA2_VROTR(w15, 7), SHA2_VROTR(w15, 18)),
+                                       _mm_srli_epi32(w15, 3));
+            __m128i t = _mm_add_epi32(_mm_add_epi32(x[0], s0), w7);
+            // sigma1 of w[j-2], w[j-1] completes lanes 0 and 1
+            __m128i w2 = _mm_shuffle_epi32(x[3], 0xFE);
+            __m128i s1 = _mm_xor_si128(_mm_xor_si128(SHA2_VROTR(w2, 17), SHA2_VROTR(w2, 19)),
+                                       _mm_srli_epi32(w2, 10));
+            t = _mm_add_epi32(t, _mm_move_epi64(s1));
+            // sigma1 of the freshly computed w[j], w[j+1] completes lanes 2 and 3
+            w2 = _mm_shuffle_epi32(t, 0x40);
+            s1 = _mm_xor_si128(_mm_xor_si128(SHA2_VROTR(w2, 17), SHA2_VROTR(w2, 19)),
+                               _mm_srli_epi32(w2, 10));
+            t = _mm_add_epi32(t, _mm_slli_si128(_mm_srli_si128(s1, 8), 8));
+            x[0] = x[1];
+            x[1] = x[2];
+            x[2] = x[3];
+            x[3] = t;
+            _mm_store_si128((__m128i *) &wk[j], _mm_add_epi32(t, _mm_loadu_si128((const __m128i *) &sha256_k[j])));
+        }
+        uint32 a = m_h[0], b = m_h[1], c = m_h[2], d = m_h[3];
+        uint32 e = m_h[4], f = m_h[5], g = m_h[6], h = m_h[7];
+        for (j = 0; j < 64; j += 8) {
+            SHA2_ROUND(a, b, c, d, e, f, g, h, wk[j + 0]);
+            SHA2_ROUND(h, a, b, c, d, e, f, g, wk[j + 1]);
+            SHA2_ROUND(g, h, a, b, c, d, e, f, wk[j + 2]);
+            SHA2_ROUND(f, g, h, a, b, c, d, e, wk[j + 3]);
+            SHA2_ROUND(e, f, g, h, a, b, c, d, wk[j + 4]);
+            SHA2_ROUND(d, e, f, g, h, a, b, c, wk[j + 5]);
+            SHA2_ROUND(c, d, e, f, g, h, a, b, wk[j + 6]);
+            SHA2_ROUND(b, c, d, e, f, g, h, a, wk[j + 7]);
+        }
+        m_h[0] += a; m_h[1] += b; m_h[2] += c; m_h[3] += d;
+        m_h[4] += e; m_h[5] += f; m_h[6] += g; m_h[7] += h;
+    }
+}
+
+/**
+ * Intel SHA extensions kernel. The state is kept in the ABEF/CDGH register layout the sha256rnds2 instruction
+ * expects, each loop iteration performs four rounds and extends the message schedule by four words.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(unsigned int *m_h, const unsigned char *message, unsigned int block_nb)
+{
+    const unsigned int *sha256_k = SHA256::k();
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp, msg;
+    __m128i x[4];
+
+    // Reorder the state from ABCD EFGH into ABEF CDGH
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &m_h[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &m_h[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (unsigned int i = 0; i < block_nb; i++) {
+        const unsigned char *sub_block = message + (i << 6);
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        for (int j = 0; j < 4; j++)
+            x[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (sub_block + 16 * j)), bswap);
+
+        for (int j = 0; j < 16; j++) {
+            msg = _mm_add_epi32(x[j & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * j]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+            if (j < 12) {
+                // w[j+4] = msg2(msg1(w[j], w[j+1]) + w[j+3..j+2] shifted by one word, w[j+3])
+                tmp = _mm_sha256msg1_epu32(x[j & 3], x[(j + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(x[(j + 3) & 3], x[(j + 2) & 3], 4));
+                x[j & 3] = _mm_sha256msg2_epu32(tmp, x[(j + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    // Back from ABEF CDGH into ABCD EFGH
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &m_h[0], state0);
+    _mm_storeu_si128((__m128i *) &m_h[4], state1);
+}
+
+// Rounds only with the SHA extensions, wk already holds the full message schedule plus round constants.
+__attribute__((target("sha,sse4.1")))
+static void sha256_rounds_shani(unsigned int *m_h, const unsigned int *wk)
+{
+    __m128i state0, state1, tmp, msg;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &m_h[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &m_h[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+
+    for (int j = 0; j < 16; j++) {
+        msg = _mm_loadu_si128((const __m128i *) &wk[4 * j]);
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &m_h[0], state0);
+    _mm_storeu_si128((__m128i *) &m_h[4], state1);
+}
+
+#endif
+
+typedef void (*sha256_transform_fn)(unsigned int *, const unsigned char *, unsigned int);
+typedef void (*sha256_rounds_fn)(unsigned int *, const unsigned int *);
+
+struct sha256_kernel {
+    sha256_transform_fn transform;
+    sha256_rounds_fn rounds;
+    const char *name;
+};
+
+// Picks the fastest compression function the CPU supports, see sha256_active_kernel().
+static sha256_kernel sha256_select_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    bool ssse3 = false, sse41 = false, sha = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        ssse3 = (ecx & bit_SSSE3) != 0;
+        sse41 = (ecx & bit_SSE4_1) != 0;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        sha = (ebx & bit_SHA) != 0;
+    if (sha && sse41 && ssse3)
+        return {sha256_transform_shani, sha256_rounds_shani, "sha-ni"};
+    if (ssse3)
+        return {sha256_transform_ssse3, sha256_rounds_scalar, "ssse3"};
+#endif
+    return {sha256_transform_scalar, sha256_rounds_scalar, "scalar"};
+}
+
+// Selected on first use, so hashing from the static initializer of another translation unit finds it set up.
+static const sha256_kernel &sha256_active_kernel()
+{
+    static const sha256_kernel kernel = sha256_select_kernel();
+    return kernel;
+}
+
+void SHA256::transform(const unsigned char *message, unsigned int block_nb)
+{
+    sha256_active_kernel().transform(m_h, message, block_nb);
+}
+
+const char *SHA256::implementation()
+{
+    return sha256_active_kernel().name;
+}
+
+/**
+ * Interior node hashing
+ *
+ * An interior node hashes exactly two child digests (64 bytes) or one (32 bytes). A 64 byte message is one data
+ * block followed by a padding block that is always the same (0x80, zeros, bit length 512), so the padding block's
+ * whole message schedule, with the round constants added, is computed once here and its compression is rounds only.
+ * Both helpers also skip the SHA256 class buffering and copy the digests straight into the block.
+ */
+struct sha256_padding_schedule {
+    unsigned int wk[64];
+
+    sha256_padding_schedule()
+    {
+        typedef unsigned int uint32;
+        uint32 w[64] = {0x80000000};
+        w[15] = 512;
+        for (int j = 16; j < 64; j++) {
+            w[j] = SHA256_F4(w[j - 2]) + w[j - 7] + SHA256_F3(w[j - 15]) + w[j - 16];
+        }
+        for (int j = 0; j < 64; j++) {
+            wk[j] = w[j] + SHA256::k()[j];
+        }
+    }
+};
+
+// Built on first use, the round constants are not usable in a constant expression
+static const sha256_padding_schedule &sha256_padding_64()
+{
+    static const sha256_padding_schedule schedule;
+    return schedule;
+}
+
+static void sha256_write_digest(const unsigned int *m_h, unsigned char *digest)
+{
+    typedef unsigned char uint8;
+    for (int i = 0; i < 8; i++) {
+        SHA2_UNPACK32(m_h[i], &digest[i << 2]);
+    }
+}
+
+void sha256_hash_children(const unsigned char *left, const unsigned char *right, unsigned char *digest)
+{
+    unsigned int m_h[8];
+    unsigned char block[64];
+    memcpy(m_h, sha256_h0, sizeof(m_h));
+    memcpy(block, left, SHA256::DIGEST_SIZE);
+    memcpy(block + SHA256::DIGEST_SIZE, right, SHA256::DIGEST_SIZE);
+    const sha256_kernel &kernel = sha256_active_kernel();
+    kernel.transform(m_h, block, 1);
+    kernel.rounds(m_h, sha256_padding_64().wk);
+    sha256_write_digest(m_h, digest);
+}
+
+void sha256_hash_child(const unsigned char *child, unsigned char *digest)
+{
+    typedef unsigned char uint8;
+    unsigned int m_h[8];
+    unsigned char block[64] = {0};
+    memcpy(m_h, sha256_h0, sizeof(m_h));
+    memcpy(block, child, SHA256::DIGEST_SIZE);
+    block[SHA256::DIGEST_SIZE] = 0x80;
+    SHA2_UNPACK32(SHA256::DIGEST_SIZE << 3, block + 60);
+    sha256_active_kernel().transform(m_h, block, 1);
+    sha256_write_digest(m_h, digest);
+}
  
 void SHA256::init()
 {
-    m_h[0] = 0x6a09e667;
-    m_h[1] = 0xbb67ae85;
-    m_h[2] = 0x3c6ef372;
-    m_h[3] = 0xa54ff53a;
-    m_h[4] = 0x510e527f;
-    m_h[5] = 0x9b05688c;
-    m_h[6] = 0x1f83d9ab;
-    m_h[7] = 0x5be0cd19;
+    for (int i = 0; i < 8; i++) {
+        m_h[i] = sha256_h0[i];
+    }
     m_len = 0;
     m_tot_len = 0;
 }
@@ -126,7 +426,287 @@ std::string sha256(std::string input)
  
     char buf[2*SHA256::DIGEST_SIZE+1];
     buf[2*SHA256::DIGEST_SIZE] = 0;
-    for (int i = 0; i < SHA256::DIGEST_SIZE; i++)
+    for (unsigned int i = 0; i < SHA256::DIGEST_SIZE; i++)
         sprintf(buf+i*2, "%02x", digest[i]);
     return std::string(buf);
 }
+
+/**
+ * Multi-buffer SHA-256
+ *
+ * The kernels below hash several independent messages of the same length at once, one message per 32-bit SIMD
+ * lane. Because every lane has the same length every lane has the same number of blocks and the same padding
+ * layout, so the only per lane work is loading the words of its current block.
+ */
+
+// Builds the padded final block(s) of a message, returns how many blocks were written to tail (1 or 2)
+static unsigned int sha256_pad_tail(const unsigned char *message, unsigned int len, unsigned char *tail)
+{
+    unsigned int rem = len & 63;
+    unsigned int block_nb = (rem + 9 <= 64) ? 1 : 2;
+    unsigned long long len_b = (unsigned long long) len << 3;
+    memset(tail, 0, block_nb << 6);
+    memcpy(tail, message + (len - rem), rem);
+    tail[rem] = 0x80;
+    for (int i = 0; i < 8; i++)
+        tail[(block_nb << 6) - 1 - i] = (unsigned char) (len_b >> (8 * i));
+    return block_nb;
+}
+
+static inline unsigned int sha256_load_be32(const unsigned char *p)
+{
+    typedef unsigned int uint32;
+    uint32 x;
+    SHA2_PACK32(p, &x);
+    return x;
+}
+
+// Hashes count messages one at a time with the single stream kernel, used for leftovers that do not fill a vector
+static void sha256_many_single(const unsigned char *const *messages, unsigned int len, unsigned int count,
+                               unsigned char *digests)
+{
+    // interior nodes have the fixed length paths
+    if (len == 2 * SHA256::DIGEST_SIZE) {
+        for (unsigned int i = 0; i < count; i++)
+            sha256_hash_children(messages[i], messages[i] + SHA256::DIGEST_SIZE, digests + i * SHA256::DIGEST_SIZE);
+        return;
+    }
+    if (len == SHA256::DIGEST_SIZE) {
+        for (unsigned int i = 0; i < count; i++)
+            sha256_hash_child(messages[i], digests + i * SHA256::DIGEST_SIZE);
+        return;
+    }
+    SHA256 ctx;
+    for (unsigned int i = 0; i < count; i++) {
+        ctx.init();
+        ctx.update(messages[i], len);
+        ctx.final(digests + i * SHA256::DIGEST_SIZE);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define SHA2_V8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA2_V8_XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+// Eight messages per call, one in each 32-bit lane of a ymm register.
+__attribute__((target("avx2")))
+static void sha256_x8_avx2(const unsigned char *const *messages, unsigned int len, unsigned char *digests)
+{
+    typedef unsigned char uint8;
+    typedef unsigned int uint32;
+    const uint32 *sha256_k = SHA256::k();
+    const unsigned int full_nb = len >> 6;
+    unsigned char tail[8][128];
+    unsigned int tail_nb = 0;
+    for (int l = 0; l < 8; l++)
+        tail_nb = sha256_pad_tail(messages[l], len, tail[l]);
+
+    __m256i h[8];
+    for (int j = 0; j < 8; j++)
+        h[j] = _mm256_set1_epi32((int) sha256_h0[j]);
+
+    for (unsigned int b = 0; b < full_nb + tail_nb; b++) {
+        const unsigned char *p[8];
+        for (int l = 0; l < 8; l++)
+            p[l] = b < full_nb ? messages[l] + (b << 6) : tail[l] + ((b - full_nb) << 6);
+
+        __m256i w[16];
+        for (int t = 0; t < 16; t++) {
+            w[t] = _mm256_set_epi32((int) sha256_load_be32(p[7] + 4 * t), (int) sha256_load_be32(p[6] + 4 * t),
+                                    (int) sha256_load_be32(p[5] + 4 * t), (int) sha256_load_be32(p[4] + 4 * t),
+                                    (int) sha256_load_be32(p[3] + 4 * t), (int) sha256_load_be32(p[2] + 4 * t),
+                                    (int) sha256_load_be32(p[1] + 4 * t), (int) sha256_load_be32(p[0] + 4 * t));
+        }
+
+        __m256i a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int j = 0; j < 64; j++) {
+            if (j >= 16) {
+                __m256i w15 = w[(j - 15) & 15], w2 = w[(j - 2) & 15];
+                __m256i s0 = SHA2_V8_XOR3(SHA2_V8_ROTR(w15, 7), SHA2_V8_ROTR(w15, 18), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = SHA2_V8_XOR3(SHA2_V8_ROTR(w2, 17), SHA2_V8_ROTR(w2, 19), _mm256_srli_epi32(w2, 10));
+                w[j & 15] = _mm256_add_epi32(_mm256_add_epi32(w[j & 15], s0),
+                                             _mm256_add_epi32(w[(j - 7) & 15], s1));
+            }
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(hh, ch),
+                                          _mm256_add_epi32(SHA2_V8_XOR3(SHA2_V8_ROTR(e, 6), SHA2_V8_ROTR(e, 11),
+                                                                        SHA2_V8_ROTR(e, 25)),
+                                                           _mm256_add_epi32(_mm256_set1_epi32((int) sha256_k[j]),
+                                                                            w[j & 15])));
+            __m256i t2 = _mm256_add_epi32(SHA2_V8_XOR3(SHA2_V8_ROTR(a, 2), SHA2_V8_ROTR(a, 13),
+                                                       SHA2_V8_ROTR(a, 22)), maj);
+            hh = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = bb;
+            bb = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+        h[0] = _mm256_add_epi32(h[0], a);
+        h[1] = _mm256_add_epi32(h[1], bb);
+        h[2] = _mm256_add_epi32(h[2], c);
+        h[3] = _mm256_add_epi32(h[3], d);
+        h[4] = _mm256_add_epi32(h[4], e);
+        h[5] = _mm256_add_epi32(h[5], f);
+        h[6] = _mm256_add_epi32(h[6], g);
+        h[7] = _mm256_add_epi32(h[7], hh);
+    }
+
+    alignas(32) uint32 out[8][8];
+    for (int j = 0; j < 8; j++)
+        _mm256_store_si256((__m256i *) out[j], h[j]);
+    for (int l = 0; l < 8; l++) {
+        for (int j = 0; j < 8; j++) {
+            SHA2_UNPACK32(out[j][l], digests + l * SHA256::DIGEST_SIZE + (j << 2));
+        }
+    }
+}
+
+// maskz forms of the shifts, the unmasked intrinsics trip -Wmaybe-uninitialized in GCC's own header (see blake3.cpp)
+#define SHA2_V16_ROTR(x, n) _mm512_maskz_ror_epi32((__mmask16) 0xffff, x, n)
+#define SHA2_V16_SHR(x, n) _mm512_maskz_srli_epi32((__mmask16) 0xffff, x, n)
+#define SHA2_V16_XOR3(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x96)
+
+// Sixteen messages per call, AVX-512 adds native rotates and three input logic ops for ch/maj.
+__attribute__((target("avx512f")))
+static void sha256_x16_avx512(const unsigned char *const *messages, unsigned int len, unsigned char *digests)
+{
+    typedef unsigned char uint8;
+    typedef unsigned int uint32;
+    const uint32 *sha256_k = SHA256::k();
+    const unsigned int full_nb = len >> 6;
+    unsigned char tail[16][128];
+    unsigned int tail_nb = 0;
+    for (int l = 0; l < 16; l++)
+        tail_nb = sha256_pad_tail(messages[l], len, tail[l]);
+
+    __m512i h[8];
+    for (int j = 0; j < 8; j++)
+        h[j] = _mm512_set1_epi32((int) sha256_h0[j]);
+
+    for (unsigned int b = 0; b < full_nb + tail_nb; b++) {
+        const unsigned char *p[16];
+        for (int l = 0; l < 16; l++)
+            p[l] = b < full_nb ? messages[l] + (b << 6) : tail[l] + ((b - full_nb) << 6);
+
+        __m512i w[16];
+        for (int t = 0; t < 16; t++) {
+            alignas(64) uint32 lanes[16];
+            for (int l = 0; l < 16; l++)
+                lanes[l] = sha256_load_be32(p[l] + 4 * t);
+            w[t] = _mm512_load_si512((const void *) lanes);
+        }
+
+        __m512i a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int j = 0; j < 64; j++) {
+            if (j >= 16) {
+                __m512i w15 = w[(j - 15) & 15], w2 = w[(j - 2) & 15];
+                __m512i s0 = SHA2_V16_XOR3(SHA2_V16_ROTR(w15, 7), SHA2_V16_ROTR(w15, 18),
+                                           SHA2_V16_SHR(w15, 3));
+                __m512i s1 = SHA2_V16_XOR3(SHA2_V16_ROTR(w2, 17), SHA2_V16_ROTR(w2, 19),
+                                           SHA2_V16_SHR(w2, 10));
+                w[j & 15] = _mm512_add_epi32(_mm512_add_epi32(w[j & 15], s0),
+                                             _mm512_add_epi32(w[(j - 7) & 15], s1));
+            }
+            __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+            __m512i maj = _mm512_ternarylogic_epi32(a, bb, c, 0xE8);
+            __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(hh, ch),
+                                          _mm512_add_epi32(SHA2_V16_XOR3(SHA2_V16_ROTR(e, 6),
+                                                                         SHA2_V16_ROTR(e, 11),
+                                                                         SHA2_V16_ROTR(e, 25)),
+                                                           _mm512_add_epi32(_mm512_set1_epi32((int) sha256_k[j]),
+                                                                            w[j & 15])));
+            __m512i t2 = _mm512_add_epi32(SHA2_V16_XOR3(SHA2_V16_ROTR(a, 2), SHA2_V16_ROTR(a, 13),
+                                                        SHA2_V16_ROTR(a, 22)), maj);
+            hh = g;
+            g = f;
+            f = e;
+            e = _mm512_add_epi32(d, t1);
+            d = c;
+            c = bb;
+            bb = a;
+            a = _mm512_add_epi32(t1, t2);
+        }
+        h[0] = _mm512_add_epi32(h[0], a);
+        h[1] = _mm512_add_epi32(h[1], bb);
+        h[2] = _mm512_add_epi32(h[2], c);
+        h[3] = _mm512_add_epi32(h[3], d);
+        h[4] = _mm512_add_epi32(h[4], e);
+        h[5] = _mm512_add_epi32(h[5], f);
+        h[6] = _mm512_add_epi32(h[6], g);
+        h[7] = _mm512_add_epi32(h[7], hh);
+    }
+
+    alignas(64) uint32 out[8][16];
+    for (int j = 0; j < 8; j++)
+        _mm512_store_si512((void *) out[j], h[j]);
+    for (int l = 0; l < 16; l++) {
+        for (int j = 0; j < 8; j++) {
+            SHA2_UNPACK32(out[j][l], digests + l * SHA256::DIGEST_SIZE + (j << 2));
+        }
+    }
+}
+
+#endif
+
+typedef void (*sha256_many_fn)(const unsigned char *const *, unsigned int, unsigned char *);
+
+struct sha256_many_kernel {
+    sha256_many_fn hash;
+    unsigned int lanes;
+};
+
+/**
+ * Picks the widest multi-buffer kernel the CPU (and OS, for the ymm/zmm state) supports. When the SHA extensions
+ * are present a single sha-ni stream is already faster per message than eight AVX2 lanes and on par with sixteen
+ * AVX-512 lanes, so the multi-buffer kernels are only used without them.
+ */
+static sha256_many_kernel sha256_select_many_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (sha256_active_kernel().transform == sha256_transform_shani)
+        return {nullptr, 1};
+    unsigned int eax, ebx, ecx, edx;
+    bool osxsave = false, avx2 = false, avx512 = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        osxsave = (ecx & bit_OSXSAVE) != 0;
+    if (osxsave && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        avx2 = (ebx & bit_AVX2) != 0 && (xcr0_lo & 0x6) == 0x6;
+        avx512 = (ebx & bit_AVX512F) != 0 && (xcr0_lo & 0xe6) == 0xe6;
+    }
+    if (avx512)
+        return {sha256_x16_avx512, 16};
+    if (avx2)
+        return {sha256_x8_avx2, 8};
+#endif
+    return {nullptr, 1};
+}
+
+// Selected on first use like sha256_active_kernel
+static const sha256_many_kernel &sha256_active_many_kernel()
+{
+    static const sha256_many_kernel kernel = sha256_select_many_kernel();
+    return kernel;
+}
+
+void sha256_many(const unsigned char *const *messages, unsigned int len, unsigned int count, unsigned char *digests)
+{
+    const sha256_many_kernel &kernel = sha256_active_many_kernel();
+    unsigned int i = 0;
+    if (kernel.hash != nullptr) {
+        for (; i + kernel.lanes <= count; i += kernel.lanes)
+            kernel.hash(messages + i, len, digests + i * SHA256::DIGEST_SIZE);
+    }
+    sha256_many_single(messages + i, len, count - i, digests + i * SHA256::DIGEST_SIZE);
+}
+
+unsigned int sha256_many_lanes()
+{
+    return sha256_active_many_kernel().lanes;
+}
@@ -16,6 +16,10 @@ public:
     void update(const unsigned char *message, unsigned int len);
     void final(unsigned char *digest);
     static const unsigned int DIGEST_SIZE = ( 256 / 8);
+    // Name of the compression kernel selected for this CPU ("sha-ni", "ssse3" or "scalar")
+    static const char *implementation();
+    // Round constants, shared with the SIMD kernels
+    static const uint32 *k();
  
 protected:
     void transform(const unsigned char *message, unsigned int block_nb);
@@ -26,6 +30,23 @@ protected:
 };
  
 std::string sha256(std::string input);
+
+/**
+ * Merkle interior node helpers: sha256(left || right) and sha256(child) for 32 byte binary digests. Equivalent to
+ * the SHA256 class but specialised for the fixed input lengths, see sha256.cpp.
+ */
+void sha256_hash_children(const unsigned char *left, const unsigned char *right, unsigned char *digest);
+void sha256_hash_child(const unsigned char *child, unsigned char *digest);
+
+/**
+ * Hashes count independent messages that are all len bytes long, writing count * DIGEST_SIZE bytes of binary
+ * digests. Uses a 16 lane AVX-512 or 8 lane AVX2 kernel when available, leftovers go through the single stream
+ * SHA256 class.
+ */
+void sha256_many(const unsigned char *const *messages, unsigned int len, unsigned int count, unsigned char *digests);
+
+// Number of messages the selected multi-buffer kernel hashes per call (1 when there is no SIMD kernel)
+unsigned int sha256_many_lanes();
  
 #define SHA2_SHFR(x, n)    (x >> n)
 #define SHA2_ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))